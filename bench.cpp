@@ -0,0 +1,374 @@
+#include "coroutine.hpp"
+#include "properator.hpp"
+#include "sudoku.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+// Benchmarks for the execution environment.
+//   ./bench [filter]
+// Each case is run `repetitions' times and the median is reported.
+
+// Count every heap allocation so regressions in the message path show
+// up even when the timing is noisy.
+#if defined(__GNUC__) and !defined(__clang__)
+// GCC can't tell these malloc and free are a pair.
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+std::atomic<unsigned long> allocations=0;
+void* operator new(size_t n){
+	allocations.fetch_add(1,std::memory_order_relaxed);
+	if(void* p=malloc(n?n:1)) return p;
+	throw std::bad_alloc();
+}
+void operator delete(void* p)noexcept{free(p);}
+void operator delete(void* p,size_t)noexcept{::operator delete(p);}
+
+// Counts what arrives on port 1, ignores shutdowns.
+struct Sink:Properator{
+	unsigned long count=0;
+	Sink(UID id):Properator(id){}
+	void receive(Message, uint port,UID,uint,std::shared_ptr<Properator>){
+		if(port==1) count++;
+	}
+};
+// A port to post from that nobody else is using.
+UID source(){return new_uid();}
+void drain(){while(main_loop_step());}
+void shutdown(std::vector<UID> const&ids){
+	for(auto id:ids)
+		crash_or_shutdown(false,id,Message({0}));
+	drain();
+}
+
+struct Result{
+	double seconds;
+	unsigned long messages;
+	unsigned long allocations;
+};
+struct Case{
+	char const* name;
+	// Set up, run the timed part through `time', and tear down.  Returns
+	// how many messages were delivered.
+	std::function<unsigned long(std::function<void(std::function<void()>)>)> body;
+};
+Result measure(Case const& c){
+	Result r{0,0,0};
+	r.messages=c.body([&](std::function<void()> timed){
+		auto a=allocations.load();
+		auto start=std::chrono::steady_clock::now();
+		timed();
+		r.seconds=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+		r.allocations=allocations.load()-a;
+	});
+	return r;
+}
+
+int const repetitions=5;
+
+Message payload(){return Message({Tuple{{1},{2}}});}
+
+unsigned long latency(std::function<void(std::function<void()>)> time){
+	// One post and one delivery at a time.
+	unsigned long const n=200000;
+	auto sink=spawn_properator<Sink>();
+	auto from=source();
+	make_channel<BasicChannel>({from,1,sink,1});
+	time([&](){
+		for(unsigned long i=0;i<n;i++){
+			post(from,1,payload());
+			main_loop_step();}
+	});
+	shutdown({sink});
+	return n;
+}
+unsigned long relay_chain(std::function<void(std::function<void()>)> time){
+	unsigned long const length=1000,n=200;
+	std::vector<UID> relays;
+	for(unsigned long i=0;i<length;i++)
+		relays.push_back(spawn_properator<Relay>());
+	auto sink=spawn_properator<Sink>();
+	auto from=source();
+	make_channel<BasicChannel>({from,1,relays.front(),1});
+	for(unsigned long i=0;i+1<length;i++)
+		make_channel<BasicChannel>({relays[i],1,relays[i+1],1});
+	make_channel<BasicChannel>({relays.back(),1,sink,1});
+	time([&](){
+		for(unsigned long i=0;i<n;i++)
+			post(from,1,payload());
+		drain();
+	});
+	relays.push_back(sink);
+	shutdown(relays);
+	return n*(length+1);
+}
+// The same chain, recorded and then replayed from a checkpoint.
+unsigned long record_replay(std::function<void(std::function<void()>)> time,bool replaying){
+	unsigned long const length=1000,n=200;
+	std::vector<UID> relays;
+	for(unsigned long i=0;i<length;i++)
+		relays.push_back(spawn_properator<Relay>());
+	auto sink=spawn_properator<Sink>();
+	for(unsigned long i=0;i+1<length;i++)
+		make_channel<BasicChannel>({relays[i],1,relays[i+1],1});
+	make_channel<BasicChannel>({relays.back(),1,sink,1});
+	for(unsigned long i=0;i<n;i++)
+		post(0,0,relays.front(),1,payload());
+	relays.push_back(sink);
+	restorable<Sink>();
+	auto start=checkpoint();
+	if(!replaying){
+		time([&](){
+			start_recording();
+			drain();
+			stop_recording();
+		});
+	}else{
+		start_recording();
+		drain();
+		auto trace=stop_recording();
+		crash_or_shutdown(false,relays,Message({0}));
+		drain();
+		restore(start);
+		time([&](){
+			if(!replay(trace)) abort();
+		});
+	}
+	shutdown(relays);
+	return n*length;
+}
+unsigned long fan_out(std::function<void(std::function<void()>)> time){
+	unsigned long const width=64,n=5000;
+	std::vector<UID> sinks;
+	auto from=source();
+	for(unsigned long i=0;i<width;i++){
+		sinks.push_back(spawn_properator<Sink>());
+		make_channel<BasicChannel>({from,1,sinks.back(),1});}
+	time([&](){
+		for(unsigned long i=0;i<n;i++)
+			post(from,1,payload());
+		drain();
+	});
+	shutdown(sinks);
+	return n*width;
+}
+unsigned long spawn_teardown(std::function<void(std::function<void()>)> time){
+	unsigned long const n=2000;
+	time([&](){
+		std::vector<UID> relays;
+		for(unsigned long i=0;i<n;i++){
+			relays.push_back(spawn_properator<Relay>());
+			if(i) make_channel<BasicChannel>({relays[i-1],1,relays[i],1});}
+		shutdown(relays);
+	});
+	return 0;
+}
+unsigned long checkpoint_restore(std::function<void(std::function<void()>)> time){
+	// A chain with a message waiting on every link.
+	unsigned long const n=2000;
+	std::vector<UID> relays;
+	for(unsigned long i=0;i<n;i++){
+		relays.push_back(spawn_properator<Relay>());
+		if(i) make_channel<BasicChannel>({relays[i-1],1,relays[i],1});}
+	for(unsigned long i=1;i<n;i++)
+		post(relays[i-1],1,relays[i],1,payload());
+	time([&](){
+		auto snapshot=checkpoint();
+		crash_or_shutdown(false,relays,Message({0}));
+		drain();
+		restore(snapshot);
+	});
+	shutdown(relays);
+	return 0;
+}
+// A typical control message, a few scalars and a string in a Tuple.
+Message wire_message(){
+	return Message({Tuple{{Symbol("Add Cell")},{UID(42)},{LinkSpec{1,1,2,1}},
+												{Tuple{{1},{2.5f},{std::string("a short string")}}}}});
+}
+unsigned long wire_encode(std::function<void(std::function<void()>)> time){
+	unsigned long const n=200000;
+	auto m=wire_message();
+	std::vector<std::byte> buffer;
+	time([&](){
+		for(unsigned long i=0;i<n;i++){
+			buffer.clear();
+			encode(m,buffer);}
+	});
+	return n;
+}
+unsigned long wire_decode(std::function<void(std::function<void()>)> time){
+	unsigned long const n=200000;
+	std::vector<std::byte> buffer;
+	encode(wire_message(),buffer);
+	time([&](){
+		for(unsigned long i=0;i<n;i++)
+			if(!decode(buffer)) abort();
+	});
+	return n;
+}
+// Reading one nested field without decoding the rest.
+unsigned long wire_view(std::function<void(std::function<void()>)> time){
+	unsigned long const n=200000;
+	std::vector<std::byte> buffer;
+	encode(wire_message(),buffer);
+	time([&](){
+		for(unsigned long i=0;i<n;i++)
+			if(MessageView::of(buffer)[3][2].as_string()->size()!=14) abort();
+	});
+	return n;
+}
+// Eight chains made side by side, so neighbouring UIDs are on
+// different chains, run in parallel with and without homes.
+unsigned long chains(std::function<void(std::function<void()>)> time,unsigned threads,bool placed){
+	unsigned long const count=8,length=250,n=50;
+	std::vector<UID> all;
+	std::vector<std::vector<UID>> relays(count);
+	for(unsigned long i=0;i<length;i++)
+		for(auto& chain:relays)
+			all.push_back(chain.emplace_back(spawn_properator<Relay>()));
+	for(auto& chain:relays){
+		auto sink=spawn_properator<Sink>();
+		all.push_back(sink);
+		for(unsigned long i=0;i+1<length;i++)
+			make_channel<BasicChannel>({chain[i],1,chain[i+1],1});
+		make_channel<BasicChannel>({chain.back(),1,sink,1});}
+	if(placed) place(partition(threads));
+	time([&](){
+		for(unsigned long i=0;i<n;i++)
+			for(auto& chain:relays)
+				post(0,0,chain.front(),1,payload());
+		run(threads);
+	});
+	shutdown(all);
+	return n*count*length;
+}
+// Request and reply through a Relay, n times, written as a receive
+// that counts and as a coroutine.
+struct Pinger:Properator{
+	unsigned long left=0;
+	Pinger(UID id):Properator(id){}
+	void receive(Message m, uint port,UID,uint,std::shared_ptr<Properator>){
+		if(port==2) left=std::get<int>(m.body);
+		else if(port!=1 or !left--) return;
+		if(left) post(id,1,payload());
+	}
+};
+struct CoPinger:CoProperator{
+	CoPinger(UID id):CoProperator(id){}
+	Task body()override{
+		for(int n=co_await next<int>(2);n>0;n--)
+			co_await request(1,payload(),1);
+	}
+};
+template<typename P> unsigned long ping(std::function<void(std::function<void()>)> time){
+	int const n=100000;
+	auto pinger=spawn_properator<P>();
+	auto relay=spawn_properator<Relay>();
+	make_channel<BasicChannel>({pinger,1,relay,1});
+	make_channel<BasicChannel>({relay,1,pinger,1});
+	time([&](){
+		post(0,0,pinger,2,Message({n}));
+		drain();
+	});
+	shutdown({pinger,relay});
+	return 2*n;
+}
+// Timers spread over the wheel's levels, added and cancelled, and
+// timers all due on the next tick, added and fired.
+unsigned long timers(std::function<void(std::function<void()>)> time,bool firing){
+	unsigned long const n=100000;
+	auto sink=spawn_properator<Sink>();
+	std::vector<TimerID> ids(n);
+	time([&](){
+		for(unsigned long i=0;i<n;i++)
+			ids[i]=post_after(std::chrono::milliseconds(firing?0:i*37),0,0,sink,1,payload());
+		if(firing)
+			run_until_quiescent();
+		else
+			for(auto id:ids)
+				cancel_timer(id);
+	});
+	shutdown({sink});
+	return n;
+}
+int puzzles[][9][9]={
+	{{5,0,0, 4,6,7, 3,0,9},{9,0,3, 8,1,0, 4,2,7},{1,7,4, 2,0,3, 0,0,0},
+	 {2,3,1, 9,7,6, 8,5,4},{8,5,7, 1,2,4, 0,9,0},{4,9,6, 3,0,8, 1,7,2},
+	 {0,0,0, 0,8,9, 2,6,0},{7,8,2, 6,4,1, 0,0,5},{0,1,0, 0,0,0, 7,0,8}},
+	{{5,0,0, 0,1,0, 0,0,4},{2,7,4, 0,0,0, 6,0,0},{0,8,0, 9,0,4, 0,0,0},
+	 {8,1,0, 4,6,0, 3,0,2},{0,0,2, 0,3,0, 1,0,0},{7,0,6, 0,9,1, 0,5,8},
+	 {0,0,0, 5,0,3, 0,1,0},{0,0,5, 0,0,0, 9,2,7},{1,0,0, 0,2,0, 0,0,3}},
+	{{0,8,0, 6,0,0, 0,1,0},{0,0,0, 0,0,8, 2,5,6},{0,0,1, 0,0,0, 0,0,0},
+	 {0,0,0, 9,0,4, 6,0,3},{0,0,9, 0,7,0, 5,0,0},{4,0,7, 5,0,2, 0,0,0},
+	 {0,0,0, 0,0,0, 8,0,0},{7,1,3, 4,0,0, 0,0,0},{0,5,0, 0,0,9, 0,3,0}},
+	{{0,0,0, 0,0,0, 0,0,0},{8,3,0, 1,5,0, 0,7,4},{0,2,0, 6,8,0, 0,9,0},
+	 {0,7,0, 0,0,0, 1,3,0},{0,4,0, 5,0,1, 0,0,7},{9,0,3, 0,7,0, 0,4,0},
+	 {7,8,6, 0,0,0, 0,1,2},{0,0,1, 0,0,8, 0,0,0},{0,0,4, 2,0,0, 0,0,0}},
+};
+unsigned long sudoku(std::function<void(std::function<void()>)> time,unsigned threads){
+	time([&](){
+		for(auto& p:puzzles)
+			sudoku_solver(p,threads,false);
+	});
+	return 0;
+}
+
+// Needs search, propagation alone decides nothing new.
+int hard[9][9]={{8,0,0, 0,0,0, 0,0,0},{0,0,3, 6,0,0, 0,0,0},{0,7,0, 0,9,0, 2,0,0},
+								{0,5,0, 0,0,7, 0,0,0},{0,0,0, 0,4,5, 7,0,0},{0,0,0, 1,0,0, 0,3,0},
+								{0,0,1, 0,0,0, 0,6,8},{0,0,8, 5,0,0, 0,1,0},{0,9,0, 0,0,0, 4,0,0}};
+unsigned long search(std::function<void(std::function<void()>)> time){
+	time([&](){
+		int g[9][9];
+		std::copy(&hard[0][0],&hard[0][0]+81,&g[0][0]);
+		sudoku_search(g,false);
+	});
+	return 0;
+}
+
+int main(int argc,char** argv){
+	unsigned const threads=std::max(2u,std::thread::hardware_concurrency());
+	std::vector<Case> cases={
+		{"post->receive latency",latency},
+		{"relay chain (1000 hops)",relay_chain},
+		{"fan-out (64 channels)",fan_out},
+		{"request/reply, receive",ping<Pinger>},
+		{"request/reply, coroutine",ping<CoPinger>},
+		{"relay chain, recording",[](auto t){return record_replay(t,false);}},
+		{"relay chain, replaying",[](auto t){return record_replay(t,true);}},
+		{"relay chains, parallel",[&](auto t){return chains(t,threads,false);}},
+		{"relay chains, placed",[&](auto t){return chains(t,threads,true);}},
+		{"timers, add+cancel",[](auto t){return timers(t,false);}},
+		{"timers, add+fire",[](auto t){return timers(t,true);}},
+		{"spawn+teardown (2000 nodes)",spawn_teardown},
+		{"checkpoint+restore (2000)",checkpoint_restore},
+		{"wire encode",wire_encode},
+		{"wire decode",wire_decode},
+		{"wire view (one field)",wire_view},
+		{"sudoku corpus (4 puzzles)",[](auto t){return sudoku(t,1);}},
+		{"sudoku corpus, parallel",[&](auto t){return sudoku(t,threads);}},
+		{"sudoku search (hard)",[](auto t){return search(t);}},
+	};
+	printf("%-30s %12s %14s %12s %14s\n","benchmark","seconds","messages/sec","ns/message","allocs/message");
+	for(auto const& c:cases){
+		if(argc>1 and !strstr(c.name,argv[1])) continue;
+		std::vector<Result> rs;
+		for(int i=0;i<repetitions;i++)
+			rs.push_back(measure(c));
+		std::sort(rs.begin(),rs.end(),[](auto const&a,auto const&b){return a.seconds<b.seconds;});
+		auto r=rs[rs.size()/2];
+		if(r.messages)
+			printf("%-30s %12.6f %14.0f %12.1f %14.2f\n",c.name,r.seconds,
+						 r.messages/r.seconds,1e9*r.seconds/r.messages,double(r.allocations)/r.messages);
+		else
+			printf("%-30s %12.6f %14s %12s %14lu\n",c.name,r.seconds,"-","-",r.allocations);
+	}
+}
@@ -0,0 +1,169 @@
+#ifndef __COROUTINE__
+#define __COROUTINE__
+
+#include "typed.hpp"
+
+#include <coroutine>
+#include <deque>
+
+// Coroutine Properators
+// A protocol with several steps can be written as one function that
+// waits for each message in turn, rather than a receive that has to
+// work out where it's up to from what it was sent:
+//   struct Client:CoProperator{
+//     Client(UID id):CoProperator(id){}
+//     Task body()override{
+//       for(;;){
+//         int n=co_await next<int>(1);
+//         int f=co_await request<int>(2,Message({n}),2);
+//         post(id,1,Message({f}));
+//       }
+//     }
+//   };
+// The body starts with the first message and runs on whichever worker
+// is delivering, like receive does.  Messages wait in a queue per port
+// until the body asks for them, so one that's already there is taken
+// without suspending and a loop can drain a whole batch in one go,
+// without going round the scheduler.  Port 0 is only queued while the
+// body waits on it, otherwise on_system sees it.  When the body
+// returns the properator shuts down, and a payload that doesn't decode
+// crashes it.  Its state is in the coroutine frame, so it can't be
+// checkpointed part way through.
+
+struct Delivery{
+	Message m;
+	UID from;
+	uint from_port;
+};
+
+struct CoProperator:Properator{
+	struct Task{
+		struct promise_type{
+			Task get_return_object(){return Task{std::coroutine_handle<promise_type>::from_promise(*this)};}
+			std::suspend_always initial_suspend() noexcept{return {};}
+			std::suspend_always final_suspend() noexcept{return {};}
+			void return_void(){}
+			void unhandled_exception(){std::terminate();}
+		};
+		std::coroutine_handle<promise_type> h;
+		explicit Task(std::coroutine_handle<promise_type> _h=nullptr):h(_h){}
+		Task(Task&& t):h(std::exchange(t.h,nullptr)){}
+		Task& operator=(Task&& t){
+			if(h) h.destroy();
+			h=std::exchange(t.h,nullptr);
+			return *this;}
+		~Task(){if(h) h.destroy();}
+	};
+	// What the body is waiting for, from anyone when `from' is 0, and
+	// for next<T> whether a payload decodes.
+	struct Want{
+		uint port;
+		UID from;
+		bool (*fits)(Message const&);
+	};
+	struct Wait{
+		CoProperator& p;
+		Want want;
+		bool await_ready(){return p.here(want)>0;}
+		void await_suspend(std::coroutine_handle<>){
+			if(p.here(want)<0) // It came, but it's the wrong shape
+				p.fail(want);
+			else
+				p.waiting=want;}
+		Delivery await_resume(){return p.take(want);}
+	};
+	template<typename T> struct WaitFor:Wait{
+		static bool fits(Message const&m){return bool(Payload<T>::from(m));}
+		T await_resume(){return std::move(*Payload<T>::from(Wait::await_resume().m));}
+	};
+
+	CoProperator(UID _id):Properator(_id){}
+	virtual Task body()=0;
+
+	Wait next(uint port,UID from=0){return {*this,{port,from,nullptr}};}
+	template<typename T> WaitFor<T> next(uint port,UID from=0){
+		return {{*this,{port,from,&WaitFor<T>::fits}}};}
+	// Post on `out' and wait for the answer on `in'.
+	Wait request(uint out,Message m,uint in){
+		post(id,out,std::move(m));
+		return next(in);}
+	template<typename T> WaitFor<T> request(uint out,Message m,uint in){
+		post(id,out,std::move(m));
+		return next<T>(in);}
+
+	// Port 0 when the body isn't waiting on it, shutdowns are ignored.
+	virtual void on_system(Message m,UID,uint){
+		if(auto t=std::get_if<Tuple>(&m.body))
+			if(t->size())
+				if(auto head=(*t)[0];std::holds_alternative<Symbol>(head.body) and
+					 std::get<Symbol>(head.body)==ShuttingDown)
+					return;
+		crash_or_shutdown(true,id,std::move(m));
+	}
+
+	void receive(Message m,uint port,UID from,uint from_port,std::shared_ptr<Properator>)override{
+		if(port==0 and !(waiting and waiting->port==0)){
+			on_system(std::move(m),from,from_port);
+			return;}
+		queue(port).push_back({std::move(m),from,from_port});
+		carry_on();
+	}
+	void receive_batch(std::span<Message> ms,uint port,UID from,uint from_port,std::shared_ptr<Properator> self)override{
+		if(port==0){
+			Properator::receive_batch(ms,port,from,from_port,std::move(self));
+			return;}
+		auto& q=queue(port);
+		for(auto&m:ms)
+			q.push_back({std::move(m),from,from_port});
+		carry_on();
+	}
+private:
+	Task task;
+	std::optional<Want> waiting;
+	bool over=false; // Returned or crashed
+	std::vector<std::deque<Delivery>> mailbox; // By port
+
+	std::deque<Delivery>& queue(uint port){
+		if(port>=mailbox.size()) mailbox.resize(port+1);
+		return mailbox[port];
+	}
+	std::deque<Delivery>::iterator find(Want const&w){
+		auto& q=queue(w.port);
+		if(!w.from) return q.begin();
+		return std::find_if(q.begin(),q.end(),[&](Delivery const&d){return d.from==w.from;});
+	}
+	// 1 if it's here, 0 if not yet, -1 if it won't decode.
+	int here(Want const&w){
+		auto it=find(w);
+		if(it==mailbox[w.port].end()) return 0;
+		return !w.fits or w.fits(it->m)?1:-1;
+	}
+	Delivery take(Want const&w){
+		auto it=find(w);
+		auto d=std::move(*it);
+		mailbox[w.port].erase(it);
+		return d;
+	}
+	void fail(Want const&w){
+		over=true;
+		crash_or_shutdown(true,id,take(w).m);
+	}
+	// Start the body, or resume it if what it's waiting for is here.
+	void carry_on(){
+		if(over) return;
+		if(!task.h)
+			task=body();
+		else if(!waiting)
+			return;
+		else if(auto h=here(*waiting);h<=0){
+			if(h<0) fail(*waiting);
+			return;}
+		waiting.reset();
+		task.h.resume();
+		if(task.h.done() and !over){
+			over=true;
+			crash_or_shutdown(false,id,Message({"Done"}));}
+	}
+};
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef __DOMAIN__
+#define __DOMAIN__
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__AVX2__) or defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Packed Domains
+// A finite domain of up to 16 values is one uint16_t, bit v for value
+// v.  The kernels below look at a whole constraint group, a row or box
+// or any other list of cells, in a few vector instructions.  They use
+// AVX2 or SSE2 when the compiler has them and plain loops otherwise;
+// all three give the same answers, and the plain loops are kept in
+// domain_detail to check that.  Groups are at most 64 cells.
+typedef uint16_t Domain;
+
+inline bool single(Domain d){return d and !(d&(d-1));}
+
+// What a group's cells can still be, as value masks.
+struct GroupScan{
+	Domain any;     // Possible somewhere
+	Domain hidden;  // Possible in exactly one cell
+	Domain fixed;   // The only value of some cell
+	Domain clash;   // The only value of more than one cell
+};
+// Two cells that can only be the same two values.
+struct NakedPair{
+	Domain values;
+	uint64_t cells; // Bit i for cell i
+};
+
+namespace domain_detail{
+// Counting to two: `once' has what's been seen, `twice' what's been
+// seen more than once.  Combining counts is associative, so the lanes
+// of a vector can be folded together in any order.
+inline void count(Domain& once,Domain& twice,Domain d){
+	twice|=once&d;
+	once|=d;
+}
+inline GroupScan scan_scalar(Domain const* d,size_t n){
+	Domain once=0,twice=0,fixed=0,clash=0;
+	for(size_t i=0;i<n;i++){
+		count(once,twice,d[i]);
+		if(single(d[i])) count(fixed,clash,d[i]);
+	}
+	return {once,Domain(once&~twice),fixed,clash};
+}
+inline size_t naked_pairs_scalar(Domain const* d,size_t n,NakedPair* out){
+	size_t found=0;
+	uint64_t seen=0;
+	for(size_t a=0;a<n;a++){
+		if(std::popcount(unsigned(d[a]))!=2 or seen>>a&1) continue;
+		uint64_t same=0;
+		for(size_t b=0;b<n;b++)
+			if(d[b]==d[a]) same|=uint64_t(1)<<b;
+		seen|=same;
+		if(std::popcount(same)==2)
+			out[found++]={d[a],same};
+	}
+	return found;
+}
+#if defined(__AVX2__)
+typedef __m256i Lanes;
+constexpr size_t width=16;
+inline Lanes load(Domain const* d,size_t n){
+	if(n>=width) return _mm256_loadu_si256((Lanes const*)d);
+	alignas(32) Domain t[width]={};
+	for(size_t i=0;i<n;i++) t[i]=d[i];
+	return _mm256_load_si256((Lanes const*)t);
+}
+inline Lanes zero(){return _mm256_setzero_si256();}
+inline Lanes band(Lanes a,Lanes b){return _mm256_and_si256(a,b);}
+inline Lanes bor(Lanes a,Lanes b){return _mm256_or_si256(a,b);}
+inline Lanes andnot(Lanes a,Lanes b){return _mm256_andnot_si256(a,b);} // ~a&b
+inline Lanes minus1(Lanes a){return _mm256_sub_epi16(a,_mm256_set1_epi16(1));}
+inline Lanes is_zero(Lanes a){return _mm256_cmpeq_epi16(a,zero());}
+inline Lanes equal(Lanes a,Lanes b){return _mm256_cmpeq_epi16(a,b);}
+inline Lanes splat(Domain d){return _mm256_set1_epi16(short(d));}
+inline uint32_t mask(Lanes a){return uint32_t(_mm256_movemask_epi8(a));} // Two bits a lane
+// Fold the lanes' counts into lane 0.
+inline void fold(Lanes& once,Lanes& twice){
+	auto step=[&](Lanes o,Lanes t){
+		twice=bor(bor(twice,t),band(once,o));
+		once=bor(once,o);};
+	step(_mm256_permute2x128_si256(once,once,1),_mm256_permute2x128_si256(twice,twice,1));
+	step(_mm256_srli_si256(once,8),_mm256_srli_si256(twice,8));
+	step(_mm256_srli_si256(once,4),_mm256_srli_si256(twice,4));
+	step(_mm256_srli_si256(once,2),_mm256_srli_si256(twice,2));
+}
+inline Domain lane0(Lanes a){return Domain(_mm256_extract_epi16(a,0));}
+#elif defined(__SSE2__)
+typedef __m128i Lanes;
+constexpr size_t width=8;
+inline Lanes load(Domain const* d,size_t n){
+	if(n>=width) return _mm_loadu_si128((Lanes const*)d);
+	alignas(16) Domain t[width]={};
+	for(size_t i=0;i<n;i++) t[i]=d[i];
+	return _mm_load_si128((Lanes const*)t);
+}
+inline Lanes zero(){return _mm_setzero_si128();}
+inline Lanes band(Lanes a,Lanes b){return _mm_and_si128(a,b);}
+inline Lanes bor(Lanes a,Lanes b){return _mm_or_si128(a,b);}
+inline Lanes andnot(Lanes a,Lanes b){return _mm_andnot_si128(a,b);}
+inline Lanes minus1(Lanes a){return _mm_sub_epi16(a,_mm_set1_epi16(1));}
+inline Lanes is_zero(Lanes a){return _mm_cmpeq_epi16(a,zero());}
+inline Lanes equal(Lanes a,Lanes b){return _mm_cmpeq_epi16(a,b);}
+inline Lanes splat(Domain d){return _mm_set1_epi16(short(d));}
+inline uint32_t mask(Lanes a){return uint32_t(_mm_movemask_epi8(a));}
+inline void fold(Lanes& once,Lanes& twice){
+	auto step=[&](Lanes o,Lanes t){
+		twice=bor(bor(twice,t),band(once,o));
+		once=bor(once,o);};
+	step(_mm_srli_si128(once,8),_mm_srli_si128(twice,8));
+	step(_mm_srli_si128(once,4),_mm_srli_si128(twice,4));
+	step(_mm_srli_si128(once,2),_mm_srli_si128(twice,2));
+}
+inline Domain lane0(Lanes a){return Domain(_mm_extract_epi16(a,0));}
+#endif
+#if defined(__AVX2__) or defined(__SSE2__)
+// Cells i.. whose lanes were all ones, from a byte mask.
+inline uint64_t cells(uint32_t m,size_t i,size_t n){
+	uint64_t c=0;
+	for(size_t l=0;l<width and i+l<n;l++)
+		c|=uint64_t(m>>(2*l)&1)<<(i+l);
+	return c;
+}
+#endif
+}
+
+// One pass over the group, up to `width' cells an instruction.
+inline GroupScan scan_group(Domain const* d,size_t n){
+#if defined(__AVX2__) or defined(__SSE2__)
+	using namespace domain_detail;
+	Lanes once=zero(),twice=zero(),fixed=zero(),clash=zero();
+	for(size_t i=0;i<n;i+=width){
+		Lanes v=load(d+i,n-i);
+		// Single values have no bits left once the lowest is cleared.
+		Lanes s=band(v,andnot(is_zero(v),is_zero(band(v,minus1(v)))));
+		twice=bor(twice,band(once,v));
+		once=bor(once,v);
+		clash=bor(clash,band(fixed,s));
+		fixed=bor(fixed,s);
+	}
+	fold(once,twice);
+	fold(fixed,clash);
+	Domain o=lane0(once),t=lane0(twice);
+	return {o,Domain(o&~t),lane0(fixed),lane0(clash)};
+#else
+	return domain_detail::scan_scalar(d,n);
+#endif
+}
+
+// Every pair of cells whose domains are the same two values.  Those
+// values can be removed from the group's other cells.  Returns how
+// many were written to `out', which needs room for n/2.
+inline size_t naked_pairs(Domain const* d,size_t n,NakedPair* out){
+#if defined(__AVX2__) or defined(__SSE2__)
+	using namespace domain_detail;
+	size_t found=0;
+	uint64_t seen=0;
+	// Cells with exactly two values: clearing the lowest leaves one.
+	uint64_t twos=0;
+	for(size_t i=0;i<n;i+=width){
+		Lanes v=load(d+i,n-i);
+		Lanes x=band(v,minus1(v));
+		Lanes two=andnot(is_zero(x),is_zero(band(x,minus1(x))));
+		twos|=cells(mask(two),i,n);
+	}
+	for(auto left=twos;left;left&=left-1){
+		size_t a=size_t(std::countr_zero(left));
+		if(seen>>a&1) continue;
+		Lanes want=splat(d[a]);
+		uint64_t same=0;
+		for(size_t i=0;i<n;i+=width)
+			same|=cells(mask(equal(load(d+i,n-i),want)),i,n);
+		same&=twos;
+		seen|=same;
+		if(std::popcount(same)==2)
+			out[found++]={d[a],same};
+	}
+	return found;
+#else
+	return domain_detail::naked_pairs_scalar(d,n,out);
+#endif
+}
+
+#endif
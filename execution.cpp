@@ -1,7 +1,23 @@
 #include "properator.hpp"
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <shared_mutex>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <unistd.h>
 
 // std::cout has memory initialization problems that annoy the LLVM
 // sanitizers.  Making an unbuffered version that's safe.
@@ -10,6 +26,18 @@ Printer& operator<<(Printer& o,int const rhs){
 	printf("%d",rhs);
 	return o;
 }
+Printer& operator<<(Printer& o,unsigned const rhs){
+	printf("%u",rhs);
+	return o;
+}
+Printer& operator<<(Printer& o,double const rhs){
+	printf("%g",rhs);
+	return o;
+}
+Printer& operator<<(Printer& o,long const rhs){
+	printf("%ld",rhs);
+	return o;
+}
 Printer& operator<<(Printer& o,std::string const rhs){
 	printf("%s",rhs.c_str());
 	return o;
@@ -43,10 +71,54 @@ template<class... Ts>
 overloaded(Ts...) -> overloaded<Ts...>;
 
 // Core Types
+std::atomic<UID> last_uid=0; // Saved in checkpoints
+std::atomic<unsigned> node=0;
 UID new_uid(){
-	static UID u=0;
-	return ++u;
+	return UID(node)<<node_shift|++last_uid;
+}
+unsigned this_node(){return node;}
+void set_node(unsigned n){node=n;}
+
+// The table is a function static so Symbols can be made during static
+// initialisation in any file.
+struct SymbolTable{
+	std::mutex lock;
+	std::unordered_map<std::string,unsigned int> ids;
+	std::deque<std::string> names; // deque so name() references stay valid
+};
+SymbolTable& symbol_table(){
+	static SymbolTable t;
+	return t;
+}
+Symbol::Symbol(std::string const&name){
+	auto& t=symbol_table();
+	std::lock_guard g(t.lock);
+	auto [it,added]=t.ids.try_emplace(name,t.names.size()+1);
+	if(added) t.names.push_back(name);
+	id=it->second;
 }
+std::string const& Symbol::name() const{
+	static std::string const none;
+	if(!id) return none;
+	auto& t=symbol_table();
+	std::lock_guard g(t.lock);
+	return t.names[id-1];
+}
+Symbol const Crashed("Crashed");
+Symbol const ShuttingDown("Shutting Down");
+Symbol const NotFound("Not Found");
+Symbol const Credit("Credit");
+Symbol const Query("Query");
+
+template<typename It> void Tuple::fill(It b,It e,size_t size){
+	n=(unsigned int)size;
+	if(!n) return;
+	auto h=std::allocate_shared<Message[]>(PoolAllocator<Message>(),size);
+	std::copy(b,e,h.get());
+	heap=std::move(h);
+}
+Tuple::Tuple(std::initializer_list<Message> l){fill(l.begin(),l.end(),l.size());}
+Tuple::Tuple(std::vector<Message> const&v){fill(v.begin(),v.end(),v.size());}
 Printer& operator<<(Printer& o,LinkSpec const&rhs){
 	return o<<"link{"<<rhs.from<<":"<<rhs.from_port<<" -> "<<rhs.to<<":"<<rhs.to_port<<"}";
 }
@@ -54,10 +126,11 @@ Printer& operator<<(Printer& o,Message const&rhs){
 	std::visit(overloaded{
 			[&](int v){o<<v;},
 			[&](float v){o<<v;},
-			[&](std::string v){o<<v;},
+			[&](std::string const&v){o<<v;},
+			[&](Symbol v){o<<v.name();},
 			[&](UID id){o<<"id:"<<id;},
 			[&](LinkSpec l){o<<l;},
-			[&](std::vector<Message> vm){
+			[&](Tuple const&vm){
 				o<<"{";
 				for(auto const&m:vm)
 					o<<m<<",";
@@ -70,59 +143,399 @@ Printer& operator<<(Printer& o,Message const&rhs){
 // Execution Environment
 std::vector<std::shared_ptr<Properator>> properators;
 std::vector<std::shared_ptr<Channel>> channels;
-std::vector<LinkSpec> purge_channels(UID block){
+// Guards the two vectors above and the routing tables.  Posting takes
+// it shared, anything that adds or removes nodes or edges takes it
+// exclusively.  Always taken before a Channel::lock.
+std::shared_mutex graph_lock;
+typedef std::shared_lock<std::shared_mutex> ReadGraph;
+typedef std::unique_lock<std::shared_mutex> WriteGraph;
+
+// Routing
+// The vectors above are the owners, these tables are how messages
+// find their way.  Every change to the globals has to go through the
+// functions in this section so they don't drift apart.
+struct RouteKey{
+	UID id;
+	uint port;
+	bool operator==(RouteKey const&) const=default;
+};
+struct RouteHash{
+	static size_t mix(size_t h,size_t v){return (h^v)*0x9E3779B97F4A7C15ull;}
+	size_t operator()(RouteKey const&k) const{return mix(size_t(k.id),k.port);}
+	size_t operator()(LinkSpec const&l) const{
+		return mix(mix(mix(size_t(l.from),l.from_port),size_t(l.to)),l.to_port);}
+};
+typedef std::vector<std::shared_ptr<Channel>> Route;
+struct Adjacency{
+	Route in,out;
+};
+std::unordered_map<UID,std::shared_ptr<Properator>> properator_index;
+std::unordered_map<RouteKey,Route,RouteHash> routes_from; // from:from_port -> *
+std::unordered_map<LinkSpec,Route,RouteHash> routes_link; // from:from_port -> to:to_port
+std::unordered_map<UID,Adjacency> adjacency; // id -> channels into and out of it
+
+std::unordered_map<UID,UID> supervisor_of; // child -> supervisor
+std::unordered_map<UID,Route> orphans; // crashed child -> its old channels, until restarted
+
+// These two need graph_lock held exclusively.
+void index_properator(std::shared_ptr<Properator> p){
+	properator_index[p->id]=p;
+	p->slot=properators.size();
+	properators.push_back(p);
+}
+bool route_channel(std::shared_ptr<Channel> c){
+	auto from=properator_index.find(c->info.from);
+	auto to=properator_index.find(c->info.to);
+	if(from!=properator_index.end() and to!=properator_index.end()){
+		auto out=from->second->out_type(c->info.from_port);
+		auto in=to->second->in_type(c->info.to_port);
+		if(out and in and *out!=*in){
+			LOG_ERROR("[Type Mismatch] "<<c->info<<" "<<out->name()<<" -> "<<in->name());
+			return false;}
+	}
+	if(to!=properator_index.end())
+		c->home=to->second->home;
+	auto add=[&](Route& r,size_t Channel::*slot){
+		(*c).*slot=r.size();
+		r.push_back(c);};
+	add(routes_from[{c->info.from,c->info.from_port}],&Channel::from_slot);
+	add(routes_link[c->info],&Channel::link_slot);
+	add(adjacency[c->info.from].out,&Channel::out_slot);
+	add(adjacency[c->info.to].in,&Channel::in_slot);
+	add(channels,&Channel::slot);
+	return true;
+}
+void register_properator(std::shared_ptr<Properator> p){
+	WriteGraph g(graph_lock);
+	index_properator(std::move(p));
+}
+bool register_channel(std::shared_ptr<Channel> c){
+	WriteGraph g(graph_lock);
+	return route_channel(std::move(c));
+}
+// Swap the last element into x's place, order isn't kept.  `slot' is
+// where x keeps its index in v.
+template<typename T>
+void unslot(std::vector<std::shared_ptr<T>>& v,T& x,size_t T::*slot=&T::slot){
+	size_t i=x.*slot;
+	v[i]=std::move(v.back());
+	(*v[i]).*slot=i;
+	v.pop_back();
+}
+// Takes c out of the route at k, and the route out of m once it's empty.
+template<typename Map,typename Key>
+void unroute(Map& m,Key const&k,Channel& c,size_t Channel::*slot){
+	auto it=m.find(k);
+	if(it==m.end()) return;
+	unslot(it->second,c,slot);
+	if(it->second.empty()) m.erase(it);
+}
+// Likewise for one of a properator's lists.
+void unadjoin(UID id,Route Adjacency::*list,Channel& c,size_t Channel::*slot){
+	auto it=adjacency.find(id);
+	if(it==adjacency.end()) return;
+	unslot(it->second.*list,c,slot);
+	if(it->second.in.empty() and it->second.out.empty()) adjacency.erase(it);
+}
+// Call with graph_lock held exclusively.  Takes c out of everything
+// route_channel put it in, without looking at the rest of any of it.
+void unroute_channel(Channel& c){
+	unroute(routes_from,RouteKey{c.info.from,c.info.from_port},c,&Channel::from_slot);
+	unroute(routes_link,c.info,c,&Channel::link_slot);
+	unadjoin(c.info.from,&Adjacency::out,c,&Channel::out_slot);
+	unadjoin(c.info.to,&Adjacency::in,c,&Channel::in_slot);
+	unslot(channels,c);
+}
+void unregister_properator(Properator& p){
+	p.alive=false;
+	properator_index.erase(p.id);
+	unslot(properators,p);
+}
+std::shared_ptr<Properator> find_properator(UID id){
+	ReadGraph g(graph_lock);
+	auto it=properator_index.find(id);
+	if(it==properator_index.end()) return nullptr;
+	return it->second;
+}
+
+// Call with graph_lock held exclusively.  Removes every channel into
+// or out of the block and returns them, touching only those channels.
+Route purge_channels(std::span<UID const> block){
 	//DB("Start  Purge Channels");
-	auto is_attached=[&](std::shared_ptr<Channel> c){
-		return c->info.to == block or c->info.from==block;};
-	// This is very improvable but good enough for a moment.
-	//DB("- Find");
-	auto it=std::find_if(channels.begin(),channels.end(),is_attached);
-	//DB("- Grab Headers");
-	std::vector<LinkSpec> ret;
-	for(;it!=channels.end();it++)
-		ret.push_back((*it)->info);
-	//DB("- Erase Each");
-	channels.erase(std::remove_if(channels.begin(),channels.end(),is_attached),channels.end());
+	Route dead;
+	for(UID id:block)
+		if(auto it=adjacency.find(id);it!=adjacency.end())
+			for(auto r:{&it->second.in,&it->second.out})
+				for(auto&c:*r)
+					if(c->attached.exchange(false)) // Self links are in both lists
+						dead.push_back(c);
+	for(auto&c:dead)
+		unroute_channel(*c);
 	//DB("Finish Purge Channels");
-	return ret;
+	return dead;
+}
+
+// Metrics
+// The hooks are only called through METRIC, see metrics.hpp.  Both
+// of these run with the channel's lock held.
+#ifdef METRICS
+void note_sent(Channel& c){
+	auto& cm=c.metrics;
+	cm.sent++;
+	auto depth=c.size();
+	for(auto hw=cm.high_water.load();depth>hw and !cm.high_water.compare_exchange_weak(hw,depth););
+	cm.stamps.push_back(std::chrono::steady_clock::now());
+	while(cm.stamps.size()>depth) // Coalescing channels drop the oldest
+		cm.stamps.pop_front();
+}
+void note_taken(Channel& c,size_t n){
+	auto& cm=c.metrics;
+	cm.received+=n;
+	auto now=std::chrono::steady_clock::now();
+	for(;n and cm.stamps.size();n--){
+		cm.dwell.add((unsigned long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+										 now-cm.stamps.front()).count());
+		cm.stamps.pop_front();}
+}
+#endif
+std::atomic<long> dump_period_ms=0;
+std::atomic<long> next_dump_ms=0;
+long now_ms(){
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();}
+void metrics_dump_every(std::chrono::milliseconds period){
+	dump_period_ms=period.count();
+	next_dump_ms=now_ms()+period.count();
+}
+void maybe_dump(){
+	auto period=dump_period_ms.load();
+	if(!period) return;
+	auto now=now_ms();
+	auto due=next_dump_ms.load();
+	if(now<due or !next_dump_ms.compare_exchange_strong(due,now+period)) return;
+	metrics_dump();
 }
-std::queue<std::pair<UID,Message>> system_messages;
-void inform_next_of_kin(UID kin,std::string reason,LinkSpec link){
+MetricsSnapshot metrics_snapshot(){
+	MetricsSnapshot s;
+#ifdef METRICS
+	ReadGraph g(graph_lock);
+	for(auto const&c:channels){
+		auto& cm=c->metrics;
+		s.channels.push_back({c->info,cm.sent,cm.received,c->size(),cm.high_water,cm.dwell.read()});}
+	for(auto const&p:properators){
+		auto& pm=p->metrics;
+		s.properators.push_back({p->id,pm.received,pm.busy_ns,pm.busy.read()});}
+#endif
+	return s;
+}
+void metrics_dump(size_t top){
+	auto s=metrics_snapshot();
+	std::sort(s.channels.begin(),s.channels.end(),
+						[](auto const&a,auto const&b){return a.sent>b.sent;});
+	std::sort(s.properators.begin(),s.properators.end(),
+						[](auto const&a,auto const&b){return a.busy_ns>b.busy_ns;});
+	printf("+--- Metrics: %zu channels, %zu properators\n",s.channels.size(),s.properators.size());
+	printf("| %-28s %10s %10s %6s %6s %10s %10s\n","channel","sent","received","depth","max","dwell p50","dwell p99");
+	for(size_t i=0;i<top and i<s.channels.size();i++){
+		auto const&c=s.channels[i];
+		printf("| %6ld:%-3u -> %6ld:%-3u    %10lu %10lu %6lu %6lu %8luns %8luns\n",
+					 c.link.from,c.link.from_port,c.link.to,c.link.to_port,c.sent,c.received,c.depth,c.high_water,
+					 Histogram::percentile(c.dwell,.5),Histogram::percentile(c.dwell,.99));}
+	printf("| %-28s %10s %10s %6s %6s %10s %10s\n","properator","received","busy ms","","","busy p50","busy p99");
+	for(size_t i=0;i<top and i<s.properators.size();i++){
+		auto const&p=s.properators[i];
+		printf("| %-28ld %10lu %10.3f %6s %6s %8luns %8luns\n",p.id,p.received,p.busy_ns/1e6,"","",
+					 Histogram::percentile(p.busy,.5),Histogram::percentile(p.busy,.99));}
+	printf("+---\n");
+}
+
+// Scheduling
+// Channels queue themselves here when they go from empty to holding a
+// message.  Port 0 traffic gets its own list so that it's always done
+// first.  Served channels that still have messages go to the back,
+// which gives the same round robin that rotating `channels' did.
+std::deque<std::shared_ptr<Channel>> ready_system;
+std::deque<std::shared_ptr<Channel>> ready_normal;
+
+// While run() is going every worker has its own pair of lists instead,
+// and idle workers steal from the others.  `pending' counts the queued
+// and in progress work so the workers know when everything is done:
+// work is counted before the step that made it is uncounted, so it
+// only reaches 0 once nothing is queued and nobody is busy.  Idle
+// workers sleep until `work_epoch' moves.
+struct Worker{
+	std::mutex lock;
+	std::deque<std::shared_ptr<Channel>> system;
+	std::deque<std::shared_ptr<Channel>> normal;
+};
+std::vector<std::unique_ptr<Worker>> workers;
+std::atomic<bool> parallel=false;
+std::atomic<long> pending=0;
+std::atomic<size_t> next_injection=0;
+thread_local int worker_id=-1;
+std::atomic<unsigned long> work_epoch=0;
+std::atomic<unsigned> idlers=0;
+std::mutex idle_lock;
+std::condition_variable idle_wake;
+
+void new_work(){
+	work_epoch++;
+	if(idlers){
+		std::lock_guard g(idle_lock);
+		idle_wake.notify_one();}
+}
+void work_done(){
+	if(--pending==0){
+		work_epoch++;
+		std::lock_guard g(idle_lock);
+		idle_wake.notify_all();}
+}
+
+void schedule(std::shared_ptr<Channel> c){
+	bool system=c->info.to_port==0;
+	if(!parallel){
+		(system?ready_system:ready_normal).push_back(std::move(c));
+		return;}
+	auto home=c->home.load(std::memory_order_relaxed);
+	auto& w=*workers[home!=~0u?home%workers.size():
+									 worker_id>=0?size_t(worker_id):next_injection++%workers.size()];
+	{
+		std::lock_guard g(w.lock);
+		(system?w.system:w.normal).push_back(std::move(c));
+		pending++;
+	}
+	new_work();
+}
+void Channel::ready(){
+	if(!attached or scheduled.exchange(true)) return;
+	schedule(shared_from_this());
+}
+std::shared_ptr<Channel> next_ready(){
+	for(auto*q:{&ready_system,&ready_normal})
+		while(q->size()){
+			auto c=std::move(q->front());
+			q->pop_front();
+			c->scheduled=false;
+			if(c->attached and c->has_message())
+				return c;
+		}
+	return nullptr;
+}
+
+std::mutex system_lock;
+std::deque<std::pair<UID,Message>> system_messages;
+void forward_notice(UID to,Message const&m);
+bool network_step();
+extern std::atomic<bool> networked;
+bool timer_step();
+bool timers_pending();
+std::chrono::steady_clock::time_point next_timer();
+void idle_until(std::chrono::steady_clock::time_point until);
+void system_message(UID to,Message m){
+	if(to and node_of(to)!=this_node()){
+		forward_notice(to,m);
+		return;}
+	{
+		std::lock_guard g(system_lock);
+		system_messages.push_back({to,std::move(m)});
+	}
+	if(parallel){
+		pending++;
+		new_work();}
+}
+void inform_next_of_kin(UID kin,Symbol reason,LinkSpec link){
 	//DB("Start  Inform Next of Kin");
-	system_messages.push({kin,Message({std::vector<Message>({Message({reason}),Message({link})})})});
+	system_message(kin,Message({Tuple{{reason},{link}}}));
 	//DB("Finish Inform Next of Kin");
 }
+std::optional<std::pair<UID,Message>> next_system_message(){
+	std::lock_guard g(system_lock);
+	if(system_messages.empty()) return {};
+	auto sm=std::move(system_messages.front());
+	system_messages.pop_front();
+	return sm;
+}
 
-bool main_loop_step(){
-	//DB("starting main_loop_step");
-	auto hand_message=[&](Message m, UID src, uint src_port,UID dest,uint dst_port){
-		if(dest==0) return;  // The system isn't listening.
-		if(src!=0){
-			DB("  - handing message "<<src<<":"<<src_port<<"->"<<dest<<":"<<dst_port);
-			DB("    - "<<m);}
-		for(auto &p:properators)
-			if(p->id==dest){
-				p->receive(m,dst_port,src,src_port,p);
-				return; // Assuming UIDs are Unique
-			}
+void undeliverable(Message const&m, UID src, uint src_port,UID dest,uint dst_port){
+	if(src==0 or dest==0) return;
+	LOG_ERROR("[Undeliverable] "<<src<<":"<<src_port<<"->"<<dest<<":"<<dst_port<<" Message: "<<m);
 
-		if(src==0) return;
-		LOG_ERROR("[Undeliverable] "<<src<<":"<<src_port<<"->"<<dest<<":"<<dst_port<<" Message: "<<m);
+	WriteGraph g(graph_lock);
+	auto next_of_kin = purge_channels(std::span<UID const>(&src,1));
+	g.unlock();
+	for(auto const&c:next_of_kin)
+		if(dest==c->info.to)
+			inform_next_of_kin(c->info.from,NotFound,c->info);
+		else
+			inform_next_of_kin(c->info.to,NotFound,c->info);
+}
+// Times a call to receive, nothing without METRICS.
+struct ReceiveTimer{
+#ifdef METRICS
+	std::shared_ptr<Properator> p;
+	size_t n;
+	std::chrono::steady_clock::time_point start=std::chrono::steady_clock::now();
+	ReceiveTimer(std::shared_ptr<Properator> const&_p,size_t _n):p(_p),n(_n){}
+	~ReceiveTimer(){
+		auto ns=(unsigned long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now()-start).count();
+		p->metrics.received+=n;
+		p->metrics.busy_ns+=ns;
+		p->metrics.busy.add(ns);
+	}
+#else
+	ReceiveTimer(std::shared_ptr<Properator> const&,size_t){}
+#endif
+};
+// `p' is passed on as receive's self, so callers that don't need it
+// afterwards should move it in and save a reference count.
+void record_system(UID to,Message const&m);
+void record_batch(LinkSpec const&l,std::span<Message const> ms);
+extern std::atomic<bool> recording;
+void hand_message(std::shared_ptr<Properator> p,Message m, UID src, uint src_port,uint dst_port){
+	if(src!=0){
+		DB("  - handing message "<<src<<":"<<src_port<<"->"<<p->id<<":"<<dst_port);
+		DB("    - "<<m);}
+	ReceiveTimer t(p,1);
+	auto& r=*p;
+	r.receive(std::move(m),dst_port,src,src_port,std::move(p));
+}
+void hand_batch(std::shared_ptr<Properator> p,std::vector<Message>& ms, UID src, uint src_port,uint dst_port){
+	if(ms.size()==1){
+		hand_message(std::move(p),std::move(ms[0]),src,src_port,dst_port);
+		return;}
+	DB("  - handing "<<int(ms.size())<<" messages "<<src<<":"<<src_port<<"->"<<p->id<<":"<<dst_port);
+	ReceiveTimer t(p,ms.size());
+	auto& r=*p;
+	r.receive_batch(ms,dst_port,src,src_port,std::move(p));
+}
+// Take up to batch_quantum messages off a channel, putting it back on
+// a ready list if there's more.
+size_t batch_quantum=16;
+thread_local std::vector<Message> batch;
+std::vector<Message>& take(Channel& c){
+	batch.clear();
+	std::unique_lock g(c.lock,std::defer_lock);
+	if(!c.lock_free() or metrics_enabled) g.lock();
+	c.read_batch(batch,std::max<size_t>(batch_quantum,1));
+	// Added to, not stored, since partition() halves it concurrently.
+	c.traffic.fetch_add(batch.size(),std::memory_order_relaxed);
+	METRIC(note_taken(c,batch.size()));
+	if(batch.size() and c.has_message()) c.ready();
+	return batch;
+}
 
-		auto next_of_kin = purge_channels(src);
-		for(auto const&to_inform:next_of_kin)
-			if(dest==to_inform.to)
-				inform_next_of_kin(to_inform.from,"Not Found",to_inform);
-			else
-				inform_next_of_kin(to_inform.to,"Not Found",to_inform);
-	};
-	
-	if(system_messages.size()){
+bool main_loop_step(){
+	//DB("starting main_loop_step");
+	METRIC(maybe_dump());
+	if(auto sm=next_system_message()){
 		//DB("- Found System Message");
-		auto [to,m]=system_messages.front();
+		auto& [to,m]=*sm;
 		//DB("  :"<<m);
-		system_messages.pop();
-		hand_message(m,0,0,to,0);
+		if(to==0) return true; // The system isn't listening.
+		if(auto p=find_properator(to)){
+			if(recording) record_system(to,m);
+			hand_message(std::move(p),std::move(m),0,0,0);}
 		return true;
 	}
 
@@ -132,23 +545,306 @@ bool main_loop_step(){
 	//	DB(c->info<<".size() == "<<c->size());
 	//#endif
 
-	// Perform all work to channel 0 first
-	auto it=std::find_if(channels.begin(),channels.end(),
-											 [](std::shared_ptr<Channel> c){return
-													 c->has_message() and
-													 c->info.to_port==0;});
-	if(it==channels.end())
-		it=std::find_if(channels.begin(),channels.end(),
-										[](std::shared_ptr<Channel> c){return c->has_message();});
-	if(it==channels.end()) return false;
-	std::rotate(channels.begin(),it+1,channels.end());
-
-	Message m = channels.back()->read();
-	LinkSpec l= channels.back()->info;
-	hand_message(m,l.from,l.from_port,l.to,l.to_port);
+	auto c=next_ready();
+	if(!c) return false;
+	LinkSpec l= c->info;
+	auto& ms=take(*c);
+	if(ms.empty() or l.to==0) return true;
+	if(auto p=find_properator(l.to)){
+		if(recording) record_batch(l,ms);
+		hand_batch(std::move(p),ms,l.from,l.from_port,l.to_port);
+	}else
+		undeliverable(ms[0],l.from,l.from_port,l.to,l.to_port);
 	return true;
 }
 
+// Placement
+Placement partition(unsigned parts){
+	Placement r;
+	r.parts=std::max(1u,parts);
+	ReadGraph g(graph_lock);
+	size_t n=properators.size();
+	if(!n) return r;
+	// Edges by slot, both ways.
+	std::vector<std::vector<std::pair<size_t,unsigned long>>> edges(n);
+	for(auto const&c:channels){
+		// Halved in place, so what take() adds meanwhile isn't lost.
+		auto taken=c->traffic.load(std::memory_order_relaxed);
+		while(!c->traffic.compare_exchange_weak(taken,taken/2,std::memory_order_relaxed)){}
+		auto w=1+taken;
+		auto from=properator_index.find(c->info.from);
+		auto to=properator_index.find(c->info.to);
+		if(from==properator_index.end() or to==properator_index.end() or from==to) continue;
+		edges[from->second->slot].push_back({to->second->slot,w});
+		edges[to->second->slot].push_back({from->second->slot,w});
+	}
+	size_t room=(n+r.parts-1)/r.parts;
+	room+=std::max<size_t>(1,room/20);
+	std::vector<unsigned> part(n,~0u);
+	std::vector<size_t> sizes(r.parts,0);
+	for(size_t i=0;i<n;i++)
+		if(auto h=properators[i]->home;h<r.parts and sizes[h]<room){
+			part[i]=h;
+			sizes[h]++;}
+	// The rest go in breadth first order, filling one part after another,
+	// so each starts out next to its neighbours.
+	std::vector<size_t> order;
+	std::vector<bool> seen(n);
+	for(size_t i=0;i<n;i++){
+		if(seen[i] or part[i]!=~0u) continue;
+		seen[i]=true;
+		order.push_back(i);
+		for(size_t at=order.size()-1;at<order.size();at++)
+			for(auto [j,w]:edges[order[at]])
+				if(!seen[j] and part[j]==~0u){
+					seen[j]=true;
+					order.push_back(j);}
+	}
+	size_t fair=(n+r.parts-1)/r.parts;
+	unsigned filling=0;
+	for(auto i:order){
+		while(sizes[filling]>=fair) filling=(filling+1)%r.parts;
+		part[i]=filling;
+		sizes[filling]++;}
+	// Then everyone moves to where most of their weight is, while that
+	// part has room, until nobody moves.
+	std::vector<unsigned long> to(r.parts);
+	for(int round=0;round<16;round++){
+		size_t moved=0;
+		for(size_t i=0;i<n;i++){
+			std::fill(to.begin(),to.end(),0);
+			for(auto [j,w]:edges[i]) to[part[j]]+=w;
+			unsigned best=part[i];
+			for(unsigned q=0;q<r.parts;q++)
+				if(to[q]>to[best] and sizes[q]<room) best=q;
+			if(best==part[i]) continue;
+			sizes[part[i]]--;
+			sizes[best]++;
+			part[i]=best;
+			moved++;
+		}
+		if(!moved) break;
+	}
+	for(size_t i=0;i<n;i++){
+		r.homes.push_back({properators[i]->id,part[i]});
+		for(auto [j,w]:edges[i]){
+			r.weight+=w;
+			if(part[i]!=part[j]) r.cut+=w;}
+	}
+	r.weight/=2; // Every edge was counted from both ends
+	r.cut/=2;
+	return r;
+}
+void place(Placement const& p){
+	WriteGraph g(graph_lock);
+	for(auto [id,home]:p.homes)
+		if(auto it=properator_index.find(id);it!=properator_index.end())
+			it->second->home=home;
+	for(auto const&c:channels)
+		if(auto it=properator_index.find(c->info.to);it!=properator_index.end())
+			c->home.store(it->second->home,std::memory_order_relaxed);
+}
+std::atomic<long> place_period_ms=0;
+std::atomic<long> next_place_ms=0;
+void place_every(std::chrono::milliseconds period){
+	place_period_ms=period.count();
+	next_place_ms=now_ms()+period.count();
+}
+void maybe_place(){
+	auto period=place_period_ms.load();
+	if(!period) return;
+	auto now=now_ms();
+	auto due=next_place_ms.load();
+	if(now<due or !next_place_ms.compare_exchange_strong(due,now+period)) return;
+	place(partition(unsigned(workers.size())));
+}
+
+// Parallel Execution
+bool worker_step(size_t me){
+	METRIC(maybe_dump());
+	maybe_place();
+	if(auto sm=next_system_message()){
+		auto& [to,m]=*sm;
+		auto p=to?find_properator(to):nullptr;
+		if(p and !p->running.try_lock()){
+			// Busy, leave it for later and look for something else.
+			std::lock_guard g(system_lock);
+			system_messages.push_back(std::move(*sm));
+		}else{
+			if(p){
+				if(recording) record_system(to,m);
+				hand_message(p,std::move(m),0,0,0);
+				p->running.unlock();}
+			work_done();
+			return true;
+		}
+	}
+
+	std::shared_ptr<Channel> c;
+	auto pop=[&](Worker& w,bool steal){
+		std::lock_guard g(w.lock);
+		for(auto*q:{&w.system,&w.normal})
+			if(q->size()){
+				if(steal){
+					c=std::move(q->back());
+					q->pop_back();
+				}else{
+					c=std::move(q->front());
+					q->pop_front();}
+				return true;}
+		return false;
+	};
+	if(!pop(*workers[me],false)){
+		bool stolen=false;
+		for(size_t i=1;i<workers.size() and !stolen;i++)
+			stolen=pop(*workers[(me+i)%workers.size()],true);
+		if(!stolen) return false;
+	}
+
+	LinkSpec l=c->info;
+	auto p=l.to?find_properator(l.to):nullptr;
+	if(p and !p->running.try_lock()){
+		// Someone else is in this properator, requeue it at our back.
+		{
+			std::lock_guard g(workers[me]->lock);
+			(l.to_port==0?workers[me]->system:workers[me]->normal).push_back(std::move(c));
+		}
+		new_work(); // Nobody should sleep on it
+		return false;
+	}
+	c->scheduled=false;
+	if(c->attached)
+		if(auto& ms=take(*c);ms.size()){
+			if(p){
+				if(recording) record_batch(l,ms);
+				hand_batch(p,ms,l.from,l.from_port,l.to_port);
+			}else
+				undeliverable(ms[0],l.from,l.from_port,l.to,l.to_port);}
+	if(p) p->running.unlock();
+	work_done();
+	return true;
+}
+bool running_parallel(){return parallel;}
+bool backoff(){
+	if(!parallel) return false;
+	std::this_thread::yield();
+	return true;
+}
+RunResult run_until_quiescent(RunLimits limits){
+	using clock=std::chrono::steady_clock;
+	auto deadline=limits.timeout.count()?clock::now()+limits.timeout:clock::time_point::max();
+	std::atomic<unsigned long> steps=0;
+	std::atomic<int> stop=RunResult::Quiescent;
+	// Called after each step that did something, true to carry on.
+	auto go_on=[&](){
+		auto n=++steps;
+		if(limits.steps and n>=limits.steps)
+			stop=RunResult::OutOfSteps;
+		else if(n%64==0 and clock::now()>=deadline)
+			stop=RunResult::TimedOut;
+		return stop==RunResult::Quiescent;
+	};
+	// The last step allowed may well have been the last one needed.
+	auto result=[&](bool quiet){
+		return RunResult{quiet?RunResult::Quiescent:RunResult::Stop(stop.load()),steps};};
+	if(limits.threads<2){
+		for(;;){
+			while((timer_step() or main_loop_step() or network_step()) and go_on());
+			// Only timers left, sleep until the next.
+			if(stop!=RunResult::Quiescent or !timers_pending()) break;
+			if(clock::now()>=deadline){
+				stop=RunResult::TimedOut;
+				break;}
+			idle_until(std::min(next_timer(),deadline));
+		}
+		std::lock_guard g(system_lock);
+		return result(ready_system.empty() and ready_normal.empty() and system_messages.empty() and !timers_pending());}
+
+	unsigned n_threads=limits.threads;
+	if(place_period_ms){
+		place(partition(n_threads));
+		next_place_ms=now_ms()+place_period_ms;}
+	for(unsigned i=0;i<n_threads;i++)
+		workers.push_back(std::make_unique<Worker>());
+	// Hand out what's already waiting.
+	for(auto*q:{&ready_system,&ready_normal}){
+		size_t i=0;
+		for(auto&c:*q){
+			auto home=c->home.load(std::memory_order_relaxed);
+			auto&w=*workers[home!=~0u?home%n_threads:i++%n_threads];
+			(q==&ready_system?w.system:w.normal).push_back(std::move(c));}
+		pending+=q->size();
+		q->clear();}
+	pending+=system_messages.size();
+	parallel=true;
+
+	auto halt=[&](){
+		std::lock_guard g(idle_lock);
+		idle_wake.notify_all();
+	};
+	std::vector<std::thread> threads;
+	for(unsigned i=0;i<n_threads;i++)
+		threads.emplace_back([&,i](){
+			worker_id=int(i);
+			unsigned spins=0;
+			while(stop==RunResult::Quiescent){
+				auto epoch=work_epoch.load();
+				if(timer_step() or worker_step(i)){
+					spins=0;
+					if(!go_on()) halt();
+					continue;}
+				if(pending==0 and !network_step()){
+					if(!timers_pending()) break;
+					// Only timers left, sleep until the next unless work turns up.
+					auto until=std::min(next_timer(),deadline);
+					if(networked) until=std::min(until,clock::now()+std::chrono::milliseconds(1));
+					{
+						std::unique_lock g(idle_lock);
+						idlers++;
+						if(work_epoch==epoch and pending==0 and stop==RunResult::Quiescent)
+							idle_wake.wait_until(g,until);
+						idlers--;
+					}
+					if(clock::now()>=deadline){
+						stop=RunResult::TimedOut;
+						halt();
+						break;}
+					continue;}
+				if(clock::now()>=deadline){
+					stop=RunResult::TimedOut;
+					halt();
+					break;}
+				// Work usually turns up again soon, don't sleep straight away.
+				if(spins++<64){
+					std::this_thread::yield();
+					continue;}
+				std::unique_lock g(idle_lock);
+				idlers++;
+				if(work_epoch==epoch and pending and stop==RunResult::Quiescent)
+					idle_wake.wait_until(g,std::min(deadline,clock::now()+std::chrono::milliseconds(1)));
+				idlers--;
+			}
+			worker_id=-1;
+		});
+	for(auto&t:threads) t.join();
+
+	bool quiet=pending==0 and !timers_pending();
+	parallel=false;
+	// Stopped early, put what's left back for next time.
+	for(auto&w:workers)
+		for(auto [from,to]:{std::pair{&w->system,&ready_system},{&w->normal,&ready_normal}})
+			for(auto&c:*from)
+				to->push_back(std::move(c));
+	workers.clear();
+	pending=0;
+	return result(quiet);
+}
+void run(unsigned n_threads){
+	RunLimits limits;
+	limits.threads=n_threads;
+	run_until_quiescent(limits);
+}
+
 /*
 void GC(){
 	// Remove all Properators that don't have a channel to them.  This
@@ -159,111 +855,441 @@ void GC(){
 */
 
 void crash_or_shutdown(bool crash,UID id,Message log_message){
+	crash_or_shutdown(crash,std::span<UID const>(&id,1),std::move(log_message));
+}
+void crash_or_shutdown(bool crash,std::span<UID const> ids,Message log_message){
 	//DB("Start  crash_or_shutdown");
-	std::string reason=crash?"Crashed":"Shutting Down";
-	if(crash)
-		LOG_ERROR("["<<reason<<"] id:"<<id<<" Message:"<<log_message);
-	else
-		LOG("["<<reason<<"] id:"<<id<<" Message:"<<log_message);
+	Symbol reason=crash?Crashed:ShuttingDown;
+	for(UID id:ids)
+		if(crash)
+			LOG_ERROR("["<<reason.name()<<"] id:"<<id<<" Message:"<<log_message);
+		else
+			LOG("["<<reason.name()<<"] id:"<<id<<" Message:"<<log_message);
 
 	//DB("- Call Erase");
-	properators.erase(std::remove_if(properators.begin(),properators.end(),
-																	 [&](std::shared_ptr<Properator> p){return p->id==id;}),
-										properators.end());
+	std::unordered_set<UID> group;
+	std::vector<std::shared_ptr<Properator>> gone; // Destroyed unlocked
+	WriteGraph g(graph_lock);
+	for(UID id:ids)
+		if(auto it=properator_index.find(id);it!=properator_index.end()){
+			group.insert(id);
+			gone.push_back(it->second);
+			unregister_properator(*gone.back());}
 
-	auto next_of_kin = purge_channels(id);
-	for(auto const&to_inform:next_of_kin)
-		if(id==to_inform.to)
-			inform_next_of_kin(to_inform.from,reason,to_inform);
+	// Crashed children go back to their supervisors along with their
+	// channels, and nobody else is told.
+	std::unordered_set<UID> hushed;
+	std::vector<std::pair<UID,UID>> wake; // supervisor, child
+	for(UID id:group)
+		if(auto it=supervisor_of.find(id);it!=supervisor_of.end()){
+			if(crash and properator_index.count(it->second)){
+				hushed.insert(id);
+				wake.push_back({it->second,id});
+				orphans[id];
+			}else
+				supervisor_of.erase(it);}
+
+	std::vector<LinkSpec> next_of_kin;
+	for(auto&c:purge_channels(ids))
+		if(hushed.count(c->info.from))
+			orphans[c->info.from].push_back(std::move(c));
+		else if(hushed.count(c->info.to))
+			orphans[c->info.to].push_back(std::move(c));
 		else
+			next_of_kin.push_back(c->info);
+	g.unlock();
+	for(auto const&to_inform:next_of_kin)
+		if(!group.count(to_inform.to))
 			inform_next_of_kin(to_inform.to,reason,to_inform);
+		else if(!group.count(to_inform.from))
+			inform_next_of_kin(to_inform.from,reason,to_inform);
+	for(auto [supervisor,child]:wake)
+		system_message(supervisor,Message({Tuple{{Crashed},{child}}}));
 	//DB("Finish crash_or_shutdown");
 }
 
-bool post(UID from,uint from_port,Message message){
-	bool found=false;
-	for(auto&c:channels)
-		if(c->info.from==from and c->info.from_port==from_port){
-			found=true;
-			c->send(message);
-		}
-	if(!found)LOG("[Missing Channel] "<<from<<":"<<from_port<<" -> *");
-	return found;
-}
-bool post(UID from,uint from_port,UID to,Message message){
-	bool found=false;
-	for(auto&c:channels)
-		if(c->info.from==from and c->info.from_port==from_port and c->info.to==to){
-			found=true;
-			c->send(message);
+// One try, only moves from `m' if it's kept.
+Posted offer_on(Channel& c,Message& m){
+	std::unique_lock g(c.lock,std::defer_lock);
+	if(!c.lock_free() or metrics_enabled) g.lock();
+	auto s=c.offer(m);
+	if(s) METRIC(note_sent(c));
+	return s;
+}
+// Full channels are retried while there's someone to empty them.  Not
+// under graph_lock, the receiver may need it exclusively to get on, and
+// not when the sender is the receiver or the receiver has gone, nobody
+// will ever make room then.  Waiting is yielding between tries, there's
+// nothing to wake a sender when room is made, so a blocked sender keeps
+// its worker busy.
+Posted retry_full(Channel& c,Message m){
+	while(true){
+		if(!c.attached or c.info.from==c.info.to or !backoff()){
+			drop_full(c.info);
+			return Posted::Full;}
+		if(auto s=offer_on(c,m);s.status!=Posted::Full) return s;
+	}
+}
+Posted send_on(Channel& c,Message m){
+	auto s=offer_on(c,m);
+	if(s.status!=Posted::Full) return s;
+	return retry_full(c,std::move(m));
+}
+// A full channel, for after graph_lock has been let go.
+struct Retry{
+	std::shared_ptr<Channel> c;
+	Message m;
+};
+// Every channel that's kept gets a copy, except the last which gets
+// the original.  Tuples share their payload so copies are cheap.  The
+// ones that are full go on `full'.
+template<typename Keep> Posted fan_out(Route const&r,Message& m,Keep keep,std::vector<Retry>& full){
+	Posted worst=Posted::Queued;
+	auto offer=[&](std::shared_ptr<Channel> const&c,Message& x){
+		auto s=offer_on(*c,x);
+		if(s.status==Posted::Full)
+			full.push_back({c,std::move(x)});
+		else if(s.status>worst.status)
+			worst=s;
+	};
+	std::shared_ptr<Channel> const* last=nullptr;
+	for(auto&c:r)
+		if(keep(*c)){
+			if(last){
+				Message copy=m;
+				offer(*last,copy);}
+			last=&c;
 		}
-	if(!found)LOG_ERROR("[Missing Channel] "<<from<<":"<<from_port<<" -> "<<to<<":*");
-	return found;
-}
-bool post(UID from,uint from_port,UID to, uint to_port,Message message){
-	bool found=false;
-	for(auto&c:channels)
-		if(c->info.from==from and c->info.from_port==from_port and
-			 c->info.to==to and c->info.to_port==to_port){
-			found=true;
-			c->send(message);
+	if(!last) return Posted::NoRoute;
+	offer(*last,m);
+	return worst;
+}
+Posted retried(Posted worst,std::vector<Retry>& full){
+	for(auto& [c,m]:full)
+		if(auto s=retry_full(*c,std::move(m));s.status>worst.status)
+			worst=s;
+	return worst;
+}
+auto const every=[](Channel const&){return true;};
+Posted post(UID from,uint from_port,Message message){
+	std::vector<Retry> full;
+	Posted sent;
+	{
+		ReadGraph g(graph_lock);
+		auto it=routes_from.find({from,from_port});
+		if(it==routes_from.end()){
+			LOG("[Missing Channel] "<<from<<":"<<from_port<<" -> *");
+			return Posted::NoRoute;}
+		sent=fan_out(it->second,message,every,full);
+	}
+	return retried(sent,full);
+}
+Posted post(UID from,uint from_port,UID to,Message message){
+	std::vector<Retry> full;
+	Posted sent=Posted::NoRoute;
+	{
+		ReadGraph g(graph_lock);
+		auto it=routes_from.find({from,from_port});
+		if(it!=routes_from.end())
+			sent=fan_out(it->second,message,[&](Channel const&c){return c.info.to==to;},full);
+	}
+	if(sent.status==Posted::NoRoute)LOG_ERROR("[Missing Channel] "<<from<<":"<<from_port<<" -> "<<to<<":*");
+	return retried(sent,full);
+}
+Posted post(UID from,uint from_port,UID to, uint to_port,Message message){
+	{
+		std::vector<Retry> full;
+		Posted sent=Posted::NoRoute;
+		{
+			ReadGraph g(graph_lock);
+			if(auto it=routes_link.find({from,from_port,to,to_port});it!=routes_link.end())
+				sent=fan_out(it->second,message,every,full);
 		}
-	if(!found and from==0){
-		auto c=make_channel<BasicChannel>({from,from_port,to,to_port});
-		c->send(message);
-		return true;
+		if(sent.status!=Posted::NoRoute) return retried(sent,full);
+	}
+	if(from==0){
+		LinkSpec l{from,from_port,to,to_port};
+		auto c=node_of(to)==this_node()?make_channel<BasicChannel>(l):make_channel<RemoteChannel>(l);
+		return send_on(*c,std::move(message));
+	}
+	LOG_ERROR("[Missing Channel] "<<LinkSpec({from,from_port,to,to_port}));
+	return Posted::NoRoute;
+}
+
+// Supervision
+struct Supervisor:Properator{
+	struct Child{
+		UID id;
+		std::function<std::shared_ptr<Properator>(UID)> make;
+	};
+	SupervisorSpec spec;
+	std::mutex lock; // Guards children, always taken before graph_lock
+	std::vector<Child> children; // In the order they were started
+	std::deque<std::chrono::steady_clock::time_point> restarts;
+	Supervisor(UID _id,SupervisorSpec _spec):Properator(_id),spec(std::move(_spec)){}
+	void receive(Message m,uint port,UID,uint,std::shared_ptr<Properator>) override;
+	void restart(UID crashed);
+	void give_up();
+	void descendants(std::vector<UID>& out);
+};
+// Supervisors start their children once they're in the graph.
+void started(Properator& p){
+	if(auto s=dynamic_cast<Supervisor*>(&p);s and s->spec.init)
+		s->spec.init(s->id);
+}
+UID spawn_supervisor(SupervisorSpec spec,UID parent){
+	auto make=[spec](UID id)->std::shared_ptr<Properator>{
+		return std::allocate_shared<Supervisor>(PoolAllocator<Supervisor>(),id,spec);};
+	if(parent) return spawn_child(parent,make);
+	UID id=new_uid();
+	auto p=make(id);
+	register_properator(p);
+	started(*p);
+	return id;
+}
+UID spawn_child(UID supervisor,std::function<std::shared_ptr<Properator>(UID)> make){
+	auto s=std::dynamic_pointer_cast<Supervisor>(find_properator(supervisor));
+	if(!s){
+		LOG_ERROR("[Not A Supervisor] id:"<<supervisor);
+		return 0;}
+	UID id=new_uid();
+	auto p=make(id);
+	{
+		std::lock_guard l(s->lock);
+		s->children.push_back({id,std::move(make)});
+		WriteGraph g(graph_lock);
+		index_properator(p);
+		supervisor_of[id]=supervisor;
+	}
+	started(*p);
+	return id;
+}
+
+// Everything below this supervisor.
+void Supervisor::descendants(std::vector<UID>& out){
+	std::lock_guard l(lock);
+	for(auto const&c:children){
+		out.push_back(c.id);
+		if(auto s=std::dynamic_pointer_cast<Supervisor>(find_properator(c.id)))
+			s->descendants(out);}
+}
+void Supervisor::restart(UID crashed){
+	std::unique_lock l(lock);
+	auto it=std::find_if(children.begin(),children.end(),[&](Child const&c){return c.id==crashed;});
+	if(it==children.end()) return;
+	{
+		ReadGraph g(graph_lock);
+		if(!orphans.count(crashed)) return; // Already restarted along with a sibling
+	}
+	auto now=std::chrono::steady_clock::now();
+	restarts.push_back(now);
+	while(restarts.front()+spec.period<now)
+		restarts.pop_front();
+	if(restarts.size()>spec.intensity){
+		l.unlock();
+		give_up();
+		return;}
+
+	auto first=it,last=it+1;
+	if(spec.strategy==Restart::OneForAll) first=children.begin();
+	if(spec.strategy!=Restart::OneForOne) last=children.end();
+	// Siblings come down quietly, and so does everything under any
+	// supervisors among them; those get new children from their init.
+	std::unordered_set<UID> again,lost;
+	std::vector<UID> down;
+	for(auto c=first;c!=last;c++){
+		again.insert(c->id);
+		if(c->id==crashed) continue;
+		down.push_back(c->id);
+		if(auto s=std::dynamic_pointer_cast<Supervisor>(find_properator(c->id))){
+			size_t n=down.size();
+			s->descendants(down);
+			lost.insert(down.begin()+n,down.end());}
+	}
+	std::vector<std::shared_ptr<Properator>> gone; // Destroyed unlocked
+	Route keep;
+	std::vector<std::pair<UID,LinkSpec>> tell;
+	{
+		WriteGraph g(graph_lock);
+		for(UID d:down)
+			if(auto p=properator_index.find(d);p!=properator_index.end()){
+				gone.push_back(p->second);
+				unregister_properator(*gone.back());}
+		Route links=purge_channels(down);
+		down.push_back(crashed);
+		for(UID d:down){
+			if(lost.count(d)) supervisor_of.erase(d);
+			if(auto o=orphans.find(d);o!=orphans.end()){
+				links.insert(links.end(),o->second.begin(),o->second.end());
+				orphans.erase(o);}}
+		// Links to nodes that won't come back are reported as usual.
+		for(auto&c:links){
+			bool from_lost=lost.count(c->info.from),to_lost=lost.count(c->info.to);
+			if(!from_lost and !to_lost)
+				keep.push_back(std::move(c));
+			else if(!from_lost and !again.count(c->info.from))
+				tell.push_back({c->info.from,c->info});
+			else if(!to_lost and !again.count(c->info.to))
+				tell.push_back({c->info.to,c->info});}
+	}
+	// Constructors may make channels, so build these unlocked.
+	std::vector<std::shared_ptr<Properator>> fresh;
+	for(auto c=first;c!=last;c++)
+		fresh.push_back(c->make(c->id));
+	{
+		WriteGraph g(graph_lock);
+		for(auto&p:fresh)
+			index_properator(p);
+		for(auto&c:keep)
+			if(routes_link.count(c->info))
+				continue; // A constructor already made it
+			else if(!c->remake or !route_channel(c->remake(c->info)))
+				LOG_ERROR("[Not Restartable] "<<c->info);
+	}
+	l.unlock();
+	LOG("[Restarted] supervisor:"<<id<<" children:"<<fresh.size());
+	for(auto&p:fresh)
+		started(*p);
+	for(auto const&[kin,link]:tell)
+		inform_next_of_kin(kin,ShuttingDown,link);
+}
+// Too many restarts.  Whoever was kept in the dark about a crash is
+// told now, and the children go down normally.
+void Supervisor::give_up(){
+	std::vector<UID> all;
+	descendants(all);
+	{
+		std::lock_guard l(lock);
+		children.clear();
+	}
+	std::vector<std::pair<UID,LinkSpec>> tell;
+	{
+		WriteGraph g(graph_lock);
+		for(UID d:all){
+			supervisor_of.erase(d);
+			if(auto o=orphans.find(d);o!=orphans.end()){
+				for(auto const&c:o->second)
+					if(c->info.from!=d) tell.push_back({c->info.from,c->info});
+					else if(c->info.to!=d) tell.push_back({c->info.to,c->info});
+				orphans.erase(o);}}
 	}
-	if(!found)LOG_ERROR("[Missing Channel] "<<LinkSpec({from,from_port,to,to_port}));
-	return found;
+	for(auto const&[kin,link]:tell)
+		inform_next_of_kin(kin,Crashed,link);
+	crash_or_shutdown(false,all,Message({"Supervisor gave up"}));
+	crash_or_shutdown(true,id,Message({"Too many restarts"}));
+}
+void Supervisor::receive(Message m,uint port,UID,uint,std::shared_ptr<Properator>){
+	if(port==0)
+		if(auto t=std::get_if<Tuple>(&m.body);t and t->size()){
+			auto what=(*t)[0];
+			if(std::holds_alternative<Symbol>(what.body)){
+				auto reason=std::get<Symbol>(what.body);
+				if(reason==ShuttingDown)
+					return;
+				if(reason==Crashed and t->size()==2)
+					if(auto who=(*t)[1];std::holds_alternative<UID>(who.body)){
+						restart(std::get<UID>(who.body));
+						return;}
+			}
+		}
+	crash_or_shutdown(true,id,m);
 }
 
 // Builtin Types Implementation
-void BasicChannel::send(Message m){v.push(m);}
+void Properator::receive_batch(std::span<Message> ms,uint port,UID from,uint from_port,std::shared_ptr<Properator> self){
+	for(auto&m:ms)
+		if(alive) // The rest are dropped, as if the channel was purged.
+			receive(std::move(m),port,from,from_port,self);
+}
+bool Channel::try_send(Message m){
+	send(std::move(m));
+	return true;
+}
+std::optional<Message> Channel::try_read(){
+	if(!has_message()) return {};
+	return read();
+}
+size_t Channel::read_batch(std::vector<Message>& out,size_t max){
+	size_t n=0;
+	for(;n<max;n++){
+		auto m=try_read();
+		if(!m) break;
+		out.push_back(std::move(*m));
+	}
+	return n;
+}
+void drop_full(LinkSpec const&l){
+	LOG_ERROR("[Channel Full] "<<l);
+}
+void flow_credit(LinkSpec const&l,size_t free){
+	if(l.from) system_message(l.from,Message({Tuple{{Credit},{l},{int(free)}}}));
+}
+
+void BasicChannel::send(Message m){
+	v.push(std::move(m));
+	ready();
+}
 Message BasicChannel::read(){
-	auto m = v.front();
+	auto m = std::move(v.front());
 	v.pop();
 	return m;
 }
 bool BasicChannel::has_message() const{return v.size();}
 
-void OnlyLatests::send(Message m){v=m;}
+void OnlyLatests::send(Message m){
+	v=std::move(m);
+	ready();
+}
 Message OnlyLatests::read(){
-	auto m = *v;
-	v={};
+	auto m = std::move(*v);
+	v.reset();
 	return m;
 }
 bool OnlyLatests::has_message() const{return bool(v);}
+Posted OnlyLatests::offer(Message& m){
+	Posted s=v?Posted::Displaced:Posted::Queued;
+	send(std::move(m));
+	return s;
+}
+
+void AtomicLatests::send(Message m){
+	delete v.exchange(new Message(std::move(m)));
+	ready();
+}
+std::optional<Message> AtomicLatests::try_read(){
+	std::unique_ptr<Message> m(v.exchange(nullptr));
+	if(!m) return {};
+	return std::move(*m);
+}
+Message AtomicLatests::read(){return *try_read();}
+bool AtomicLatests::has_message() const{return v.load();}
 
 void Relay::receive(Message m, uint port,UID,uint,std::shared_ptr<Properator>){
 	switch(port){
 	case 0:
-		if(std::holds_alternative<std::vector<Message>>(m.body)){
-			auto v = std::get<std::vector<Message>>(m.body);
+		if(std::holds_alternative<Tuple>(m.body)){
+			auto const& v = std::get<Tuple>(m.body);
 			if(v.size())
-				if(std::holds_alternative<std::string>(v[0].body)){
-					auto vv = std::get<std::string>(v[0].body);
-					if(vv=="Shutting Down")
+				if(std::holds_alternative<Symbol>(v[0].body))
+					if(std::get<Symbol>(v[0].body)==ShuttingDown)
 						return;
-				}
 		}
 		crash_or_shutdown(true,id,m);
 		break;
 	default:
-		post(id,port,m);
+		post(id,port,std::move(m));
 	}
 }
 
 void MessageLogger::receive(Message m, uint port,UID from,uint from_port,std::shared_ptr<Properator>){
 	switch(port){
 	case 0:
-		if(std::holds_alternative<std::vector<Message>>(m.body)){
-			auto v = std::get<std::vector<Message>>(m.body);
+		if(std::holds_alternative<Tuple>(m.body)){
+			auto const& v = std::get<Tuple>(m.body);
 			if(v.size())
-				if(std::holds_alternative<std::string>(v[0].body)){
-					auto vv = std::get<std::string>(v[0].body);
-					if(vv=="Shutting Down")
+				if(std::holds_alternative<Symbol>(v[0].body))
+					if(std::get<Symbol>(v[0].body)==ShuttingDown)
 						return;
-				}
 		}
 		crash_or_shutdown(true,id,m);
 		break;
@@ -275,3 +1301,895 @@ void MessageLogger::receive(Message m, uint port,UID from,uint from_port,std::sh
 	}
 }
 
+
+// Wire Format
+void Writer::string(std::string_view s){
+	pod(uint32_t(s.size()));
+	auto b=reinterpret_cast<std::byte const*>(s.data());
+	out.insert(out.end(),b,b+s.size());
+}
+void Writer::link(LinkSpec const&l){
+	pod(l.from);
+	pod(uint32_t(l.from_port));
+	pod(l.to);
+	pod(uint32_t(l.to_port));
+}
+void Writer::message(Message const&m){
+	std::visit(overloaded{
+			[&](int v){pod(Wire::Int);pod(int32_t(v));},
+			[&](float v){pod(Wire::Float);pod(v);},
+			[&](std::string const&v){pod(Wire::String);string(v);},
+			[&](Symbol v){pod(Wire::Symbol);string(v.name());},
+			[&](UID v){pod(Wire::UID);pod(v);},
+			[&](LinkSpec l){pod(Wire::LinkSpec);link(l);},
+			[&](Tuple const&t){
+				pod(Wire::Tuple);
+				pod(uint32_t(t.size()));
+				size_t at=out.size();
+				pod(uint32_t(0)); // Length, once it's known
+				for(auto const&e:t)
+					message(e);
+				uint32_t n=uint32_t(out.size()-at-sizeof(uint32_t));
+				memcpy(out.data()+at,&n,sizeof(n));
+			}
+		},m.body);
+}
+std::span<std::byte const> Reader::bytes(size_t n){
+	if(in.size()<n){
+		ok=false;
+		return {};}
+	auto b=in.first(n);
+	in=in.subspan(n);
+	return b;
+}
+std::string Reader::string(){
+	auto b=bytes(pod<uint32_t>());
+	return std::string(reinterpret_cast<char const*>(b.data()),b.size());
+}
+LinkSpec Reader::link(){
+	LinkSpec l;
+	l.from=pod<UID>();
+	l.from_port=pod<uint32_t>();
+	l.to=pod<UID>();
+	l.to_port=pod<uint32_t>();
+	return l;
+}
+Message Reader::message(){
+	MessageView v(in);
+	auto n=v.bytes();
+	auto m=n?v.materialize():std::nullopt;
+	if(!m){
+		ok=false;
+		return Message({0});}
+	in=in.subspan(n);
+	return std::move(*m);
+}
+void encode(Message const&m,std::vector<std::byte>& out){
+	out.push_back(std::byte(wire_version));
+	Writer{out}.message(m);
+}
+std::optional<Message> decode(std::span<std::byte const> in){
+	auto v=MessageView::of(in);
+	if(v.empty() or v.bytes()!=in.size()-1) return {};
+	return v.materialize();
+}
+
+template<typename T> std::optional<T> read_at(std::span<std::byte const> b,size_t at){
+	if(b.size()<at+sizeof(T)) return {};
+	T v;
+	memcpy(&v,b.data()+at,sizeof(T));
+	return v;
+}
+MessageView MessageView::of(std::span<std::byte const> encoded){
+	if(encoded.size()<2 or uint8_t(encoded[0])!=wire_version) return {};
+	return encoded.subspan(1);
+}
+size_t MessageView::bytes() const{
+	if(empty()) return 0;
+	size_t n=0;
+	switch(tag()){
+	case Wire::Int:
+	case Wire::Float: n=1+4; break;
+	case Wire::UID: n=1+8; break;
+	case Wire::LinkSpec: n=1+24; break;
+	case Wire::String:
+	case Wire::Symbol:
+		if(auto l=read_at<uint32_t>(b,1)) n=1+4+size_t(*l);
+		break;
+	case Wire::Tuple:
+		if(auto l=read_at<uint32_t>(b,5)) n=1+8+size_t(*l);
+		break;
+	}
+	return n<=b.size()?n:0;
+}
+std::optional<int> MessageView::as_int() const{
+	if(empty() or tag()!=Wire::Int) return {};
+	return read_at<int32_t>(b,1);
+}
+std::optional<float> MessageView::as_float() const{
+	if(empty() or tag()!=Wire::Float) return {};
+	return read_at<float>(b,1);
+}
+std::optional<UID> MessageView::as_uid() const{
+	if(empty() or tag()!=Wire::UID) return {};
+	return read_at<UID>(b,1);
+}
+std::optional<LinkSpec> MessageView::as_link() const{
+	if(empty() or tag()!=Wire::LinkSpec or !bytes()) return {};
+	Reader r{b.subspan(1)};
+	return r.link();
+}
+std::optional<std::string_view> MessageView::as_string() const{
+	if(empty() or (tag()!=Wire::String and tag()!=Wire::Symbol)) return {};
+	auto n=bytes();
+	if(!n) return {};
+	return std::string_view(reinterpret_cast<char const*>(b.data())+5,n-5);
+}
+size_t MessageView::size() const{
+	if(empty() or tag()!=Wire::Tuple or !bytes()) return 0;
+	return *read_at<uint32_t>(b,1);
+}
+// Steps over the elements before i, never past the Tuple's end.
+MessageView MessageView::operator[](size_t i) const{
+	if(i>=size()) return {};
+	auto body=b.subspan(9,bytes()-9);
+	for(;i;i--){
+		auto n=MessageView(body).bytes();
+		if(!n) return {};
+		body=body.subspan(n);
+	}
+	return body;
+}
+std::optional<Message> MessageView::materialize() const{
+	if(empty()) return {};
+	switch(tag()){
+	case Wire::Int: if(auto v=as_int()) return Message({*v}); break;
+	case Wire::Float: if(auto v=as_float()) return Message({*v}); break;
+	case Wire::UID: if(auto v=as_uid()) return Message({*v}); break;
+	case Wire::LinkSpec: if(auto v=as_link()) return Message({*v}); break;
+	case Wire::String: if(auto v=as_string()) return Message({std::string(*v)}); break;
+	case Wire::Symbol: if(auto v=as_string()) return Message({Symbol(std::string(*v))}); break;
+	case Wire::Tuple:{
+		if(!bytes()) break;
+		auto body=b.subspan(9,bytes()-9);
+		if(size()>body.size()/5) break; // Elements are at least 5 bytes
+		std::vector<Message> v(size());
+		for(auto& e:v){
+			MessageView ev(body);
+			auto n=ev.bytes();
+			auto m=n?ev.materialize():std::nullopt;
+			if(!m) return {};
+			e=std::move(*m);
+			body=body.subspan(n);
+		}
+		if(body.size()) break; // The length and the elements disagree
+		return Message({Tuple(v)});}
+	}
+	return {};
+}
+
+// Checkpoints
+void Channel::save(Writer& w){
+	std::vector<Message> q;
+	while(has_message())
+		q.push_back(read());
+	w.pod(uint32_t(q.size()));
+	for(auto& m:q){
+		w.message(m);
+		send(std::move(m));}
+}
+void Channel::load(Reader& r){
+	auto n=r.pod<uint32_t>();
+	for(uint32_t i=0;i<n and r.ok;i++){
+		auto m=r.message();
+		if(r.ok) send(std::move(m));}
+}
+
+struct Kinds{
+	std::unordered_map<std::string,std::shared_ptr<Properator>(*)(UID)> properators;
+	std::unordered_map<std::string,std::shared_ptr<Channel>(*)(LinkSpec)> channels;
+};
+Kinds& kinds(){
+	static Kinds& k=*[]{
+		auto made=new Kinds;
+		made->properators[typeid(Relay).name()]=&remake_properator<Relay>;
+		made->properators[typeid(MessageLogger).name()]=&remake_properator<MessageLogger>;
+		made->channels[typeid(BasicChannel).name()]=&remake_channel<BasicChannel>;
+		made->channels[typeid(OnlyLatests).name()]=&remake_channel<OnlyLatests>;
+		made->channels[typeid(AtomicLatests).name()]=&remake_channel<AtomicLatests>;
+		made->channels[typeid(RemoteChannel).name()]=&remake_channel<RemoteChannel>;
+		return made;
+	}();
+	return k;
+}
+void restorable_kind(std::string const&kind,std::shared_ptr<Properator>(*make)(UID)){
+	kinds().properators[kind]=make;
+}
+void restorable_kind(std::string const&kind,std::shared_ptr<Channel>(*make)(LinkSpec)){
+	kinds().channels[kind]=make;
+}
+
+// Header, then the records of each section.  Every record's body is
+// length prefixed so a reader can skip what it doesn't want.
+struct SnapshotHeader{
+	char magic[8]={'P','R','O','P','S','N','A','P'};
+	uint32_t version=2; // Since messages went to the wire format
+	uint32_t flags=0;
+	UID last_uid;
+	uint64_t properators,channels,system_messages;
+};
+// The body goes after its length, which is filled in once known.
+template<typename F> void record(Writer& w,F body){
+	size_t at=w.out.size();
+	w.pod(uint32_t(0));
+	body();
+	uint32_t n=uint32_t(w.out.size()-at-sizeof(uint32_t));
+	memcpy(w.out.data()+at,&n,sizeof(n));
+}
+std::vector<std::byte> checkpoint(){
+	std::vector<std::byte> out;
+	Writer w{out};
+	WriteGraph g(graph_lock);
+	SnapshotHeader h;
+	h.last_uid=last_uid;
+	h.properators=properators.size();
+	h.channels=channels.size();
+	w.pod(h);
+	auto& k=kinds();
+	for(auto const&p:properators){
+		std::string kind=typeid(*p).name();
+		if(!k.properators.count(kind)){
+			LOG_ERROR("[Not Restorable] id:"<<p->id<<" kind:"<<kind);
+			return {};}
+		w.string(kind);
+		w.pod(p->id);
+		record(w,[&]{p->save(w);});
+	}
+	for(auto const&c:channels){
+		std::string kind=typeid(*c).name();
+		if(!k.channels.count(kind)){
+			LOG_ERROR("[Not Restorable] "<<c->info<<" kind:"<<kind);
+			return {};}
+		w.string(kind);
+		w.link(c->info);
+		std::lock_guard cl(c->lock);
+		record(w,[&]{c->save(w);});
+	}
+	// After the channels, since taking from one can add a system
+	// message while holding its lock.  The count goes in the header.
+	std::lock_guard sl(system_lock);
+	h.system_messages=system_messages.size();
+	memcpy(out.data(),&h,sizeof(h));
+	for(auto const&[to,m]:system_messages){
+		w.pod(to);
+		record(w,[&]{w.message(m);});
+	}
+	return out;
+}
+bool restore(std::span<std::byte const> snapshot){
+	Reader r{snapshot};
+	auto h=r.pod<SnapshotHeader>();
+	if(!r.ok or memcmp(h.magic,SnapshotHeader().magic,sizeof(h.magic)) or h.version!=SnapshotHeader().version){
+		LOG_ERROR("[Bad Snapshot] Not a snapshot, or the wrong version");
+		return false;}
+	auto& k=kinds();
+	// Everything's made before anything's added, so a bad snapshot
+	// leaves the runtime as it was.
+	std::vector<std::shared_ptr<Properator>> ps;
+	std::vector<std::pair<std::shared_ptr<Channel>,std::span<std::byte const>>> cs;
+	std::vector<std::pair<UID,Message>> sms;
+	for(uint64_t i=0;i<h.properators and r.ok;i++){
+		auto kind=r.string();
+		auto id=r.pod<UID>();
+		Reader body{r.bytes(r.pod<uint32_t>())};
+		auto make=k.properators.find(kind);
+		if(!r.ok or make==k.properators.end() or find_properator(id)){
+			LOG_ERROR("[Bad Snapshot] Can't remake id:"<<id<<" kind:"<<kind);
+			return false;}
+		ps.push_back(make->second(id));
+		ps.back()->load(body);
+		r.ok&=body.ok;
+	}
+	for(uint64_t i=0;i<h.channels and r.ok;i++){
+		auto kind=r.string();
+		auto link=r.link();
+		auto body=r.bytes(r.pod<uint32_t>());
+		auto make=k.channels.find(kind);
+		if(!r.ok or make==k.channels.end()){
+			LOG_ERROR("[Bad Snapshot] Can't remake "<<link<<" kind:"<<kind);
+			return false;}
+		cs.push_back({make->second(link),body});
+	}
+	for(uint64_t i=0;i<h.system_messages and r.ok;i++){
+		auto to=r.pod<UID>();
+		Reader body{r.bytes(r.pod<uint32_t>())};
+		sms.push_back({to,body.message()});
+		r.ok&=body.ok;
+	}
+	if(!r.ok){
+		LOG_ERROR("[Bad Snapshot] Truncated or corrupt");
+		return false;}
+	UID u=last_uid;
+	while(u<h.last_uid and !last_uid.compare_exchange_weak(u,h.last_uid)){}
+	bool ok=true;
+	{
+		WriteGraph g(graph_lock);
+		for(auto&p:ps)
+			index_properator(std::move(p));
+		// A constructor may have made some of the links already.
+		for(auto&[c,body]:cs)
+			if(auto it=routes_link.find(c->info);it!=routes_link.end())
+				c=it->second.front();
+			else if(!route_channel(c)){
+				LOG_ERROR("[Bad Snapshot] Can't route "<<c->info);
+				c=nullptr;
+				ok=false;}
+	}
+	// Queued messages go back once the channels are routed, so they're
+	// scheduled.
+	for(auto&[c,body]:cs)
+		if(c){
+			Reader b{body};
+			c->load(b);}
+	for(auto&[to,m]:sms)
+		system_message(to,std::move(m));
+	return ok;
+}
+bool checkpoint(char const* path){
+	auto snapshot=checkpoint();
+	if(snapshot.empty()) return false;
+	auto f=fopen(path,"wb");
+	if(!f) return false;
+	bool ok=fwrite(snapshot.data(),1,snapshot.size(),f)==snapshot.size();
+	return fclose(f)==0 and ok;
+}
+bool restore(char const* path){
+	int fd=open(path,O_RDONLY);
+	if(fd<0) return false;
+	struct stat st;
+	if(fstat(fd,&st) or !st.st_size){
+		close(fd);
+		return false;}
+	auto p=mmap(nullptr,size_t(st.st_size),PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if(p==MAP_FAILED) return false;
+	bool ok=restore({static_cast<std::byte const*>(p),size_t(st.st_size)});
+	munmap(p,size_t(st.st_size));
+	return ok;
+}
+
+// Record and Replay
+// A trace is a header and then one record a delivery, appended under
+// a lock so parallel workers' deliveries come out in some order they
+// could have happened in.
+std::atomic<bool> recording=false;
+std::mutex trace_lock;
+std::vector<std::byte> trace;
+struct TraceHeader{
+	char magic[7]={'P','R','O','P','T','R','C'};
+	uint8_t version=wire_version;
+};
+enum class TraceRecord:uint8_t{System,Batch};
+void record_system(UID to,Message const&m){
+	std::lock_guard g(trace_lock);
+	Writer w{trace};
+	w.pod(TraceRecord::System);
+	w.pod(to);
+	w.message(m);
+}
+void record_batch(LinkSpec const&l,std::span<Message const> ms){
+	std::lock_guard g(trace_lock);
+	Writer w{trace};
+	w.pod(TraceRecord::Batch);
+	w.link(l);
+	w.pod(uint32_t(ms.size()));
+	for(auto const&m:ms)
+		w.message(m);
+}
+void start_recording(){
+	std::lock_guard g(trace_lock);
+	trace.clear();
+	Writer{trace}.pod(TraceHeader());
+	recording=true;
+}
+std::vector<std::byte> stop_recording(){
+	std::lock_guard g(trace_lock);
+	recording=false;
+	return std::move(trace);
+}
+
+// Messages are compared by their encoding.
+bool same_message(Message const&a,Message const&b){
+	thread_local std::vector<std::byte> ea,eb;
+	ea.clear();
+	eb.clear();
+	Writer{ea}.message(a);
+	Writer{eb}.message(b);
+	return ea==eb;
+}
+ReplayResult replay(std::span<std::byte const> t){
+	ReplayResult result{ReplayResult::Diverged,0};
+	Reader r{t};
+	auto h=r.pod<TraceHeader>();
+	if(!r.ok or memcmp(h.magic,TraceHeader().magic,sizeof(h.magic)) or h.version!=wire_version){
+		LOG_ERROR("[Bad Trace] Not a trace, or the wrong version");
+		return result;}
+	auto diverged=[&](auto what){
+		LOG_ERROR("[Replay Diverged] Delivery "<<int(result.steps)<<" "<<what);
+		return result;};
+	std::vector<Message> ms;
+	while(r.in.size()){
+		auto kind=r.pod<TraceRecord>();
+		if(kind==TraceRecord::System){
+			auto to=r.pod<UID>();
+			auto want=r.message();
+			if(!r.ok) return diverged("is truncated");
+			std::optional<Message> m;
+			{
+				std::lock_guard g(system_lock);
+				auto it=std::find_if(system_messages.begin(),system_messages.end(),
+														 [&](auto const&sm){return sm.first==to and same_message(sm.second,want);});
+				if(it!=system_messages.end()){
+					m=std::move(it->second);
+					system_messages.erase(it);}
+			}
+			auto p=find_properator(to);
+			if(!m or !p) return diverged("is a system message that isn't waiting");
+			hand_message(std::move(p),std::move(*m),0,0,0);
+		}else if(kind==TraceRecord::Batch){
+			auto l=r.link();
+			auto n=r.pod<uint32_t>();
+			std::shared_ptr<Channel> c;
+			{
+				ReadGraph g(graph_lock);
+				if(auto it=routes_link.find(l);it!=routes_link.end())
+					for(auto const&x:it->second)
+						if(x->has_message()){
+							c=x;
+							break;}
+			}
+			auto p=find_properator(l.to);
+			if(!c or !p) return diverged("is on a link with nothing waiting");
+			ms.clear();
+			for(uint32_t i=0;i<n and r.ok;i++){
+				auto want=r.message();
+				std::lock_guard g(c->lock);
+				if(!r.ok or !c->has_message()) break;
+				ms.push_back(c->read());
+				if(!same_message(ms.back(),want))
+					return diverged("has a different message");
+			}
+			if(!r.ok or ms.size()!=n) return diverged("is missing messages");
+			hand_batch(std::move(p),ms,l.from,l.from_port,l.to_port);
+		}else
+			return diverged("is corrupt");
+		result.steps++;
+	}
+	result.stop=ReplayResult::Done;
+	return result;
+}
+
+// Nodes
+// A frame is its length, a kind and then a delivery (the link and the
+// message) or a notice (who to tell and what).  Frames are batched in
+// each peer's outbox and written when it's full or when there's
+// nothing else to do.
+enum class Frame:uint8_t{Deliver,Notice};
+struct Peer{
+	unsigned node;
+	int fd;
+	std::mutex lock;
+	std::vector<std::byte> outbox,inbox;
+	size_t sent=0; // How much of the outbox has gone
+	std::deque<std::vector<std::byte>> frames; // Arrived, not yet delivered
+	bool closed=false;
+};
+std::mutex peers_lock;
+std::unordered_map<unsigned,std::shared_ptr<Peer>> peers;
+std::atomic<bool> networked=false;
+size_t const flush_at=64*1024;
+
+bool connect_node(unsigned n,int fd){
+	if(fd<0) return false;
+	std::lock_guard g(peers_lock);
+	auto& p=peers[n];
+	if(p){
+		close(fd);
+		return false;}
+	p=std::make_shared<Peer>();
+	p->node=n;
+	p->fd=fd;
+	networked=true;
+	return true;
+}
+std::shared_ptr<Peer> peer(unsigned n){
+	std::lock_guard g(peers_lock);
+	auto it=peers.find(n);
+	return it==peers.end()?nullptr:it->second;
+}
+// Whatever the socket takes without blocking, false if it's broken.
+bool flush(Peer& p){
+	while(p.sent<p.outbox.size()){
+		auto n=::send(p.fd,p.outbox.data()+p.sent,p.outbox.size()-p.sent,MSG_DONTWAIT|MSG_NOSIGNAL);
+		if(n>0)
+			p.sent+=size_t(n);
+		else if(n<0 and errno==EINTR)
+			continue;
+		else
+			return n<0 and (errno==EAGAIN or errno==EWOULDBLOCK);
+	}
+	p.outbox.clear();
+	p.sent=0;
+	return true;
+}
+template<typename F> void send_frame(unsigned n,F body){
+	auto p=peer(n);
+	if(!p){
+		LOG_ERROR("[No Route To Node] "<<int(n));
+		return;}
+	std::lock_guard g(p->lock);
+	Writer w{p->outbox};
+	size_t at=p->outbox.size();
+	w.pod(uint32_t(0));
+	body(w);
+	uint32_t len=uint32_t(p->outbox.size()-at-sizeof(uint32_t));
+	memcpy(p->outbox.data()+at,&len,sizeof(len));
+	if(p->outbox.size()-p->sent>=flush_at) flush(*p);
+}
+void RemoteChannel::send(Message m){
+	send_frame(node_of(info.to),[&](Writer& w){
+		w.pod(Frame::Deliver);
+		w.link(info);
+		w.message(m);
+	});
+}
+void forward_notice(UID to,Message const&m){
+	send_frame(node_of(to),[&](Writer& w){
+		w.pod(Frame::Notice);
+		w.pod(to);
+		w.message(m);
+	});
+}
+
+// Removes the channels of one link, the other end has already gone.
+void drop_link(LinkSpec const&l){
+	WriteGraph g(graph_lock);
+	auto it=routes_link.find(l);
+	if(it==routes_link.end()) return;
+	Route dead=it->second;
+	for(auto&c:dead)
+		if(c->attached.exchange(false))
+			unroute_channel(*c);
+}
+// Everything linked to a node that's gone hears that it crashed.
+void node_down(unsigned n){
+	LOG("[Node Down] "<<int(n));
+	{
+		std::lock_guard g(peers_lock);
+		if(auto it=peers.find(n);it!=peers.end()){
+			close(it->second->fd);
+			peers.erase(it);}
+	}
+	std::vector<LinkSpec> links;
+	{
+		ReadGraph g(graph_lock);
+		for(auto const&c:channels)
+			if(node_of(c->info.from)==n or node_of(c->info.to)==n)
+				links.push_back(c->info);
+	}
+	for(auto const&l:links){
+		drop_link(l);
+		UID kin=node_of(l.to)==n?l.from:l.to;
+		if(kin and node_of(kin)==this_node())
+			system_message(kin,Message({Tuple{{Crashed},{l}}}));
+	}
+}
+bool is_notice(std::vector<std::byte> const&f){return f.size() and Frame(f[0])==Frame::Notice;}
+void deliver_frame(Reader r){
+	auto kind=r.pod<Frame>();
+	if(kind==Frame::Deliver){
+		auto l=r.link();
+		auto m=r.message();
+		if(!r.ok) return;
+		std::shared_ptr<Channel> c;
+		{
+			ReadGraph g(graph_lock);
+			if(auto it=routes_link.find(l);it!=routes_link.end())
+				c=it->second.front();
+		}
+		if(!c) c=make_channel<BasicChannel>(l);
+		if(c) send_on(*c,std::move(m));
+	}else if(kind==Frame::Notice){
+		auto to=r.pod<UID>();
+		auto m=r.message();
+		if(!r.ok) return;
+		// {reason,link}, this node's half of the link goes too.
+		if(auto t=std::get_if<Tuple>(&m.body);t and t->size()==2)
+			if(auto l=(*t)[1];std::holds_alternative<LinkSpec>(l.body))
+				drop_link(std::get<LinkSpec>(l.body));
+		system_message(to,std::move(m));
+	}
+}
+// Sends what's waiting and takes in what's arrived.  Keeps reading
+// while it waits to send, so two nodes sending each other a lot can't
+// both stall.  A notice waits until what was delivered before it has
+// been handed out, as it would have been on its own node, so the next
+// call picks up from there.  True if anything came in.
+bool network_step(){
+	static std::mutex network_lock;
+	if(!networked) return false;
+	std::unique_lock nl(network_lock,std::try_to_lock);
+	if(!nl) return false; // Another worker's at it
+	std::vector<std::shared_ptr<Peer>> ps;
+	{
+		std::lock_guard g(peers_lock);
+		for(auto const&[n,p]:peers)
+			ps.push_back(p);
+	}
+	while(true){
+		std::vector<pollfd> waiting;
+		for(auto&p:ps){
+			std::lock_guard g(p->lock);
+			if(p->closed) continue;
+			bool ok=flush(*p);
+			std::byte buffer[64*1024];
+			while(ok){
+				auto n=recv(p->fd,buffer,sizeof(buffer),MSG_DONTWAIT);
+				if(n>0)
+					p->inbox.insert(p->inbox.end(),buffer,buffer+n);
+				else if(n<0 and errno==EINTR)
+					continue;
+				else{
+					ok=n<0 and (errno==EAGAIN or errno==EWOULDBLOCK);
+					break;}
+			}
+			p->closed=!ok;
+			if(ok and p->outbox.size())
+				waiting.push_back({p->fd,POLLIN|POLLOUT,0});
+		}
+		if(waiting.empty()) break;
+		poll(waiting.data(),waiting.size(),10);
+	}
+	std::vector<std::vector<std::byte>> frames;
+	std::vector<unsigned> down;
+	for(auto&p:ps){
+		std::lock_guard g(p->lock);
+		size_t at=0;
+		uint32_t len;
+		for(;p->inbox.size()-at>=sizeof(len);at+=sizeof(len)+len){
+			memcpy(&len,p->inbox.data()+at,sizeof(len));
+			if(p->inbox.size()-at-sizeof(len)<len) break;
+			auto b=p->inbox.begin()+long(at+sizeof(len));
+			p->frames.emplace_back(b,b+len);
+		}
+		p->inbox.erase(p->inbox.begin(),p->inbox.begin()+long(at));
+		bool delivered=false;
+		while(p->frames.size() and !(delivered and is_notice(p->frames.front()))){
+			delivered|=!is_notice(p->frames.front());
+			frames.push_back(std::move(p->frames.front()));
+			p->frames.pop_front();}
+		if(p->closed and p->frames.empty())
+			down.push_back(p->node);
+	}
+	nl.unlock();
+	for(auto const&f:frames)
+		deliver_frame(Reader{f});
+	for(auto n:down)
+		node_down(n);
+	return frames.size() or down.size();
+}
+bool wait_for_network(std::chrono::milliseconds timeout){
+	std::vector<pollfd> fds;
+	{
+		std::lock_guard g(peers_lock);
+		for(auto const&[n,p]:peers)
+			fds.push_back({p->fd,POLLIN,0});
+	}
+	if(fds.empty()) return false;
+	return poll(fds.data(),fds.size(),int(timeout.count()))>0;
+}
+
+// "unix:/path" or "tcp:host:port"
+int with_address(char const* address,bool listening){
+	std::string a=address;
+	if(a.starts_with("unix:")){
+		sockaddr_un u{};
+		u.sun_family=AF_UNIX;
+		auto path=a.substr(5);
+		if(path.size()>=sizeof(u.sun_path)) return -1;
+		memcpy(u.sun_path,path.c_str(),path.size()+1);
+		int fd=socket(AF_UNIX,SOCK_STREAM,0);
+		if(fd<0) return -1;
+		if(listening) unlink(u.sun_path);
+		if(listening?bind(fd,(sockaddr*)&u,sizeof(u)) or listen(fd,16):connect(fd,(sockaddr*)&u,sizeof(u))){
+			close(fd);
+			return -1;}
+		return fd;
+	}
+	if(a.starts_with("tcp:")){
+		auto colon=a.rfind(':');
+		if(colon<4) return -1;
+		auto host=a.substr(4,colon-4),port=a.substr(colon+1);
+		addrinfo hints{},*found=nullptr;
+		hints.ai_family=AF_UNSPEC;
+		hints.ai_socktype=SOCK_STREAM;
+		hints.ai_flags=listening?AI_PASSIVE:0;
+		if(getaddrinfo(host.c_str(),port.c_str(),&hints,&found)) return -1;
+		int fd=-1;
+		for(auto i=found;i and fd<0;i=i->ai_next){
+			fd=socket(i->ai_family,i->ai_socktype,i->ai_protocol);
+			if(fd<0) continue;
+			int one=1;
+			setsockopt(fd,listening?SOL_SOCKET:IPPROTO_TCP,listening?SO_REUSEADDR:TCP_NODELAY,&one,sizeof(one));
+			if(listening?bind(fd,i->ai_addr,i->ai_addrlen) or listen(fd,16):connect(fd,i->ai_addr,i->ai_addrlen)){
+				close(fd);
+				fd=-1;}
+		}
+		freeaddrinfo(found);
+		return fd;
+	}
+	return -1;
+}
+int listen_on(char const* address){return with_address(address,true);}
+int dial(char const* address){return with_address(address,false);}
+int accept_node(int listener){
+	int fd=accept(listener,nullptr,nullptr);
+	if(fd>=0){
+		int one=1;
+		setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one)); // Fails harmlessly on Unix sockets
+	}
+	return fd;
+}
+
+// Timers
+// Four levels of 64 slots.  A slot at the bottom is one tick and a slot
+// a level up is as long as the whole level below.  A timer goes in the
+// lowest level that reaches its deadline, and when the level below comes
+// round to its slot it's moved down, so it's only ever touched once a
+// level.  A timer knows its slot, so cancelling takes it straight out.
+typedef std::chrono::steady_clock timer_clock;
+constexpr unsigned wheel_bits=6,wheel_levels=4;
+constexpr uint64_t wheel_slots=uint64_t(1)<<wheel_bits;
+struct Timer{
+	TimerID id;
+	uint64_t due,period; // In ticks, period 0 for once
+	UID from;
+	uint from_port;
+	UID to;
+	uint to_port;
+	bool direct; // To to:to_port rather than all of from:from_port
+	Message message;
+	std::vector<TimerID>* slot=nullptr; // Where it is in the wheel
+};
+std::mutex timer_lock;
+std::unordered_map<TimerID,Timer> timers;
+std::atomic<size_t> timer_count=0;
+std::vector<TimerID> wheel[wheel_levels][wheel_slots];
+uint64_t wheel_tick=0; // Every tick up to this one has been done
+TimerID last_timer=0;
+timer_clock::time_point const wheel_start=timer_clock::now();
+
+timer_clock::time_point time_of(uint64_t tick){return wheel_start+std::chrono::milliseconds(tick);}
+// Call with timer_lock held.
+void wheel_insert(Timer& timer,uint64_t due){
+	uint64_t delta=due-wheel_tick;
+	unsigned level=0;
+	while(level+1<wheel_levels and delta>=uint64_t(1)<<(wheel_bits*(level+1)))
+		level++;
+	// Beyond the top it waits in the last slot round and is put back then.
+	if(delta>=uint64_t(1)<<(wheel_bits*wheel_levels))
+		due=wheel_tick+((wheel_slots-1)<<(wheel_bits*level));
+	timer.slot=&wheel[level][due>>(wheel_bits*level)&(wheel_slots-1)];
+	timer.slot->push_back(timer.id);
+}
+// Move on a tick towards `now', appending what fires to `fired'.
+void wheel_advance(uint64_t now,std::vector<Timer>& fired){
+	auto t=++wheel_tick;
+	for(unsigned level=wheel_levels-1;level>0;level--){
+		if(t&((uint64_t(1)<<(wheel_bits*level))-1)) continue;
+		auto ids=std::move(wheel[level][t>>(wheel_bits*level)&(wheel_slots-1)]);
+		wheel[level][t>>(wheel_bits*level)&(wheel_slots-1)].clear();
+		for(auto id:ids)
+			if(auto it=timers.find(id);it!=timers.end())
+				wheel_insert(it->second,std::max(it->second.due,t));
+	}
+	auto ids=std::move(wheel[0][t&(wheel_slots-1)]);
+	wheel[0][t&(wheel_slots-1)].clear();
+	for(auto id:ids){
+		auto it=timers.find(id);
+		if(it==timers.end()) continue;
+		auto& timer=it->second;
+		if(timer.due>t){ // Waited at the top for longer than the wheel goes round
+			wheel_insert(timer,timer.due);
+			continue;}
+		fired.push_back(timer);
+		if(timer.period){
+			// Periods missed while nobody was running aren't made up.
+			timer.due=std::max(t+timer.period,now+1);
+			wheel_insert(timer,timer.due);
+		}else{
+			timers.erase(it);
+			timer_count--;}
+	}
+}
+TimerID add_timer(timer_clock::duration delay,timer_clock::duration period,Timer timer){
+	using std::chrono::ceil,std::chrono::milliseconds;
+	std::lock_guard g(timer_lock);
+	// Rounded up so it's never early, and after the ticks already done.
+	auto due=uint64_t(ceil<milliseconds>(timer_clock::now()-wheel_start+delay).count());
+	timer.due=std::max(due,wheel_tick+1);
+	timer.period=period.count()?std::max<uint64_t>(1,uint64_t(ceil<milliseconds>(period).count())):0;
+	auto id=timer.id=++last_timer;
+	auto& t=timers.emplace(id,std::move(timer)).first->second;
+	timer_count++;
+	wheel_insert(t,t.due);
+	return id;
+}
+TimerID post_after(timer_clock::duration delay,UID from,uint from_port,Message message){
+	return add_timer(delay,{},{0,0,0,from,from_port,0,0,false,std::move(message)});}
+TimerID post_after(timer_clock::duration delay,UID from,uint from_port,UID to,uint to_port,Message message){
+	return add_timer(delay,{},{0,0,0,from,from_port,to,to_port,true,std::move(message)});}
+TimerID post_every(timer_clock::duration period,UID from,uint from_port,Message message){
+	return add_timer(period,period,{0,0,0,from,from_port,0,0,false,std::move(message)});}
+TimerID post_every(timer_clock::duration period,UID from,uint from_port,UID to,uint to_port,Message message){
+	return add_timer(period,period,{0,0,0,from,from_port,to,to_port,true,std::move(message)});}
+bool cancel_timer(TimerID timer){
+	std::lock_guard g(timer_lock);
+	auto it=timers.find(timer);
+	if(it==timers.end()) return false;
+	if(auto slot=it->second.slot)
+		if(auto at=std::find(slot->begin(),slot->end(),timer);at!=slot->end())
+			slot->erase(at);
+	timers.erase(it);
+	timer_count--;
+	return true;
+}
+// Fire whatever's due, true if anything was.
+bool timer_step(){
+	if(!timer_count) return false;
+	thread_local std::vector<Timer> fired;
+	fired.clear();
+	{
+		std::unique_lock g(timer_lock,std::try_to_lock);
+		if(!g) return false; // Another worker's at it
+		auto now=uint64_t(std::chrono::floor<std::chrono::milliseconds>(timer_clock::now()-wheel_start).count());
+		while(wheel_tick<now)
+			if(timers.empty())
+				wheel_tick=now; // Nothing to move past
+			else
+				wheel_advance(now,fired);
+	}
+	for(auto& t:fired){
+		// A local receiver that's gone won't be back.
+		bool gone=t.direct and node_of(t.to)==this_node() and !find_properator(t.to);
+		if(gone or (t.direct?post(t.from,t.from_port,t.to,t.to_port,t.message):
+								post(t.from,t.from_port,t.message)).status==Posted::NoRoute)
+			cancel_timer(t.id);
+	}
+	return fired.size();
+}
+// When timer_step next has something to do, max() if never.  That's
+// the soonest over every level, since a slot further up can come round
+// before the next one down; it's early when all that's due then is to
+// move timers down.
+timer_clock::time_point next_timer(){
+	std::lock_guard g(timer_lock);
+	if(timers.empty()) return timer_clock::time_point::max();
+	uint64_t soonest=~uint64_t(0);
+	for(unsigned level=0;level<wheel_levels;level++){
+		auto at=wheel_tick>>(wheel_bits*level);
+		for(uint64_t k=1;k<=wheel_slots;k++)
+			if(wheel[level][(at+k)&(wheel_slots-1)].size()){
+				soonest=std::min(soonest,(at+k)<<(wheel_bits*level));
+				break;}
+	}
+	return time_of(soonest==~uint64_t(0)?wheel_tick+1:soonest);
+}
+bool timers_pending(){return timer_count;}
+// Nothing to do before `until', unless a node sends something.
+void idle_until(timer_clock::time_point until){
+	auto left=std::chrono::ceil<std::chrono::milliseconds>(until-timer_clock::now());
+	if(left.count()<=0) return;
+	if(!wait_for_network(left))
+		std::this_thread::sleep_until(until);
+}
@@ -1,9 +1,15 @@
+#include "coroutine.hpp"
+#include "domain.hpp"
 #include "properator.hpp"
+#include "sudoku.hpp"
+#include "typed.hpp"
+#include <algorithm>
+#include <random>
 #include <stdio.h>
-#include <map>
-
-// for operator ""s
-using namespace std::string_literals;
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
 
 // Hello World Example
 struct StringHolder:Properator{
@@ -12,12 +18,12 @@ struct StringHolder:Properator{
 	void receive(Message m, uint port,UID,uint,std::shared_ptr<Properator>){
 		switch(port){
 		case 0:
-			if(std::holds_alternative<std::vector<Message>>(m.body)){
-				auto v = std::get<std::vector<Message>>(m.body);
+			if(std::holds_alternative<Tuple>(m.body)){
+				auto const& v = std::get<Tuple>(m.body);
 				if(v.size())
-					if(std::holds_alternative<std::string>(v[0].body)){
-						auto vv = std::get<std::string>(v[0].body);
-						if(vv=="Shutting Down")
+					if(std::holds_alternative<Symbol>(v[0].body)){
+						auto vv = std::get<Symbol>(v[0].body);
+						if(vv==ShuttingDown)
 							return;
 					}
 			}
@@ -27,7 +33,7 @@ struct StringHolder:Properator{
 			if(std::holds_alternative<std::string>(m.body)){
 				auto v = std::get<std::string>(m.body);
 				if(v==value) return; // Deduplicate
-				post(id,1,m);
+				post(id,1,std::move(m));
 				return;
 			}
 			crash_or_shutdown(true,id,m);
@@ -44,588 +50,424 @@ void hello_example(){
 	auto printer = spawn_properator<MessageLogger>();
 	make_channel<BasicChannel>({s_hold,1,printer,1});
 	post(0,0,s_hold,1,Message({"Hello, World!"}));
-	while(main_loop_step());
+	run_until_quiescent();
 	crash_or_shutdown(false,printer,Message({"Example Over"}));
-	while(main_loop_step());
+	run_until_quiescent();
 	crash_or_shutdown(false,s_hold,Message({"Example Over"}));
-	while(main_loop_step());
+	run_until_quiescent();
 }
 
 // Factorial Example
-struct FactorialCalculator:Properator{
-	FactorialCalculator(UID id):Properator(id){
+struct FactorialCalculator:TypedProperator<FactorialCalculator,
+																					 In<1,int>,In<2,std::pair<int,int>>,
+																					 Out<1,int>,Out<2,std::pair<int,int>>>{
+	FactorialCalculator(UID id):TypedProperator(id){
 		// This isn't recommended to be part of a constructor, just do the
 		// work locally; but, this is a test case.
 		make_channel<BasicChannel>({id,2,id,2});
 	}
-	void receive(Message m, uint port,UID,uint,std::shared_ptr<Properator>){
-		switch(port){
-		case 0:
-			if(std::holds_alternative<std::vector<Message>>(m.body)){
-				auto v = std::get<std::vector<Message>>(m.body);
-				if(v.size())
-					if(std::holds_alternative<std::string>(v[0].body)){
-						auto vv = std::get<std::string>(v[0].body);
-						if(vv=="Shutting Down")
-							return;
-					}
-			}
-			crash_or_shutdown(true,id,m);
-			break;
-		case 1:
-			// factorial:1 n -> (n,n-1,return id, return port -> factorial:2)
-			if(std::holds_alternative<int>(m.body)){
-				auto n = std::get<int>(m.body);
-				post(id,2,id,2,Message({std::vector<Message>({
-							Message({1}),
-							Message({n})})}));
-				return;
-			}
-			crash_or_shutdown(true,id,m);
-			break;
-		case 2:
-			// factorial:2 a,n -> (a*n,n-1 -> factorial:2)
-			// factorial:2 a,0 -> (a -> listeners on port 1)
-			if(std::holds_alternative<std::vector<Message>>(m.body)){
-				auto v = std::get<std::vector<Message>>(m.body);
-				if(v.size()==2){
-					if(std::holds_alternative<int>(v[0].body) and
-						 std::holds_alternative<int>(v[1].body)){
-						auto a=std::get<int>(v[0].body);
-						auto n=std::get<int>(v[1].body);
-						if(n<0)
-							crash_or_shutdown(true,id,m);
-						else if(n==0)
-							post(id,1,Message({a}));
-						else
-							post(id,2,id,2,Message({std::vector<Message>({
-										Message({a*n}),
-										Message({n-1})})}));
-						break;
-					}
-				}
-			}
-			crash_or_shutdown(true,id,m);
-			break;
-		default:
-			crash_or_shutdown(true,id,m);
-		}
+	// factorial:1 n -> (n,n-1,return id, return port -> factorial:2)
+	void on(In<1,int>,int n){
+		emit<2>(id,2,{1,n});
+	}
+	// factorial:2 a,n -> (a*n,n-1 -> factorial:2)
+	// factorial:2 a,0 -> (a -> listeners on port 1)
+	void on(In<2,std::pair<int,int>>,std::pair<int,int> an){
+		auto [a,n]=an;
+		if(n<0)
+			crash_or_shutdown(true,id,Payload<std::pair<int,int>>::to(an));
+		else if(n==0)
+			emit<1>(a);
+		else
+			emit<2>(id,2,{a*n,n-1});
 	}
-	~FactorialCalculator()=default;
 };
 void factorial_example(){
 	auto fact = spawn_properator<FactorialCalculator>();
 	auto printer = spawn_properator<MessageLogger>();
 	make_channel<BasicChannel>({fact,1,printer,1});
 	post(0,0,fact,1,Message({5}));
-	while(main_loop_step());
+	// A step budget stops it part way, and another run carries on.
+	RunLimits limits;
+	limits.steps=3;
+	if(auto r=run_until_quiescent(limits);!r)
+		printf("Stopped after %lu steps\n",r.steps);
+	run_until_quiescent();
 	crash_or_shutdown(false,printer,Message({"Example Over"}));
-	while(main_loop_step());
+	run_until_quiescent();
 	crash_or_shutdown(false,fact,Message({"Example Over"}));
-	while(main_loop_step());
+	run_until_quiescent();
 }
 
-// Sudoku Example
-struct SudokuCell:Properator{
-	bool can_be[9]={1,1,1, 1,1,1, 1,1,1};
-	SudokuCell(UID id):Properator(id){}
-	void receive(Message m, uint port,UID caller,uint,std::shared_ptr<Properator>){
-		switch(port){
-		case 0:
-			// ["Shutting Down" . TAIL]
-			if(std::holds_alternative<std::vector<Message>>(m.body)){
-				auto v = std::get<std::vector<Message>>(m.body);
-				if(v.size())
-					if(std::holds_alternative<std::string>(v[0].body)){
-						auto vv = std::get<std::string>(v[0].body);
-						if(vv=="Shutting Down")
-							break;}}
-			crash_or_shutdown(true,id,m);
-			break;
-		case 1:
-			// [command,value] -> Do command
-			// - ["Set",value] -> Set the value
-			// - ["Ban",value] -> Ban the value
-			// "Query"       -> reply
-			if(std::holds_alternative<std::vector<Message>>(m.body)){
-				auto v = std::get<std::vector<Message>>(m.body);
-				if(v.size()==2)
-					if(std::holds_alternative<std::string>(v[0].body) and
-						 std::holds_alternative<int>(v[1].body)){
-						auto command=std::get<std::string>(v[0].body);
-						auto val=std::get<int>(v[1].body);
-						if(val<1 or val>9)
-							crash_or_shutdown(true,id,m);
-						bool changed=false;
-						if(command=="Set"){
-							for(int vl=0;vl<9;vl++)
-								if(can_be[vl]!=(vl+1==val)){
-									// If this updates to a positive, that should be a crash.
-									can_be[vl]=(vl+1==val);
-									changed=true;
-								}
-						}if(command=="Ban")
-							if((changed=can_be[val-1]))
-								can_be[val-1]=false;
-						if(changed)
-							if(can_be[0]+
-								 can_be[1]+
-								 can_be[2]+
-								 can_be[3]+
-								 can_be[4]+
-								 can_be[5]+
-								 can_be[6]+
-								 can_be[7]+
-								 can_be[8]
-								 ==0)
-								crash_or_shutdown(true,id,Message({std::vector<Message>({
-													m,
-													Message({int(can_be[0])}),
-													Message({int(can_be[1])}),
-													Message({int(can_be[2])}),
-													
-													Message({int(can_be[3])}),
-													Message({int(can_be[4])}),
-													Message({int(can_be[5])}),
-													
-													Message({int(can_be[6])}),
-													Message({int(can_be[7])}),
-													Message({int(can_be[8])})})}));
-							else
-								post(id,1,Message({std::vector<Message>({
-													Message({int(can_be[0])}),
-													Message({int(can_be[1])}),
-													Message({int(can_be[2])}),
-													
-													Message({int(can_be[3])}),
-													Message({int(can_be[4])}),
-													Message({int(can_be[5])}),
-													
-													Message({int(can_be[6])}),
-													Message({int(can_be[7])}),
-													Message({int(can_be[8])})})}));
-						break;
-					}
-			}else if(std::holds_alternative<std::string>(m.body)){
-				auto command=std::get<std::string>(m.body);
-				if(command=="Query"){
-							post(id,port,caller,
-									 Message({std::vector<Message>({
-												Message({int(can_be[0])}),
-												Message({int(can_be[1])}),
-												Message({int(can_be[2])}),
-															
-												Message({int(can_be[3])}),
-												Message({int(can_be[4])}),
-												Message({int(can_be[5])}),
-												
-												Message({int(can_be[6])}),
-												Message({int(can_be[7])}),
-												Message({int(can_be[8])})})}));
-							break;}}
-			crash_or_shutdown(true,id,m);
-			break;
-		default:
-			crash_or_shutdown(true,id,m);
+// Coroutine Example
+// Asks a FactorialCalculator for each number it's given and waits for
+// the answer, one at a time, so numbers that turn up meanwhile queue.
+struct FactorialClient:CoProperator{
+	FactorialClient(UID id):CoProperator(id){}
+	Task body()override{
+		for(;;){
+			int n=co_await next<int>(1);
+			int f=co_await request<int>(2,Message({n}),2);
+			post(id,1,Message({std::to_string(n)+"! = "+std::to_string(f)}));
 		}
 	}
 };
-struct SudokuValueAtMostOnce:Properator{
-	std::vector<UID> cells;
-	// The states are only needed for more complex things, like pairs
-	//std::map<UID,bool[9]> states;
-	SudokuValueAtMostOnce(UID id):Properator(id){}
-	void receive(Message m, uint port,UID from,uint,std::shared_ptr<Properator>){
-		switch(port){
-		case 0:
-			// ["Add Cell", UID]
-			// ["Shutting Down" . TAIL]
-			if(std::holds_alternative<std::vector<Message>>(m.body)){
-				auto v = std::get<std::vector<Message>>(m.body);
-				if(v.size()==2)
-					if(std::holds_alternative<std::string>(v[0].body)){
-						auto vv = std::get<std::string>(v[0].body);
-						if(vv=="Add Cell")
-							if(std::holds_alternative<UID>(v[1].body)){
-								auto c=std::get<UID>(v[1].body);
-								cells.push_back(c);
-								if(cells.size()>9)
-									crash_or_shutdown(true,id,Message({std::vector<Message>({
-														Message({"Too many sub-cells: "s+std::to_string(cells.size())}),
-														m})}));
-								//for(int i=0;i<9;i++)
-								//	states[c][i]=true;
-								make_channel<BasicChannel>({id,1,c,1});
-								make_channel<OnlyLatests>({c,1,id,1});
-								post(id,1,c,1,Message({"Query"}));
-								break;
-							}
-					}
-				if(v.size())
-					if(std::holds_alternative<std::string>(v[0].body)){
-						auto vv = std::get<std::string>(v[0].body);
-						if(vv=="Shutting Down")
-							break;}}
-			crash_or_shutdown(true,id,m);
-			break;
-		case 1:
-			// message::[current_state]
-			if(std::holds_alternative<std::vector<Message>>(m.body)){
-				auto v = std::get<std::vector<Message>>(m.body);
-				if(v.size()==9){
-					int found=0;
-					for(int val=0;val<9;val++)
-						if(!std::holds_alternative<int>(v[val].body))
-							crash_or_shutdown(true,id,m);
-						else
-							if(std::get<int>(v[val].body))
-								if(!found)
-									found=val+1;
-								else{
-									found=0;
-									break;}
-					if(found)
-						for(auto cell:cells)
-							if(cell!=from)
-								post(id,1,cell,1,Message({std::vector<Message>({
-													Message({"Ban"}),
-													Message({found})})}));
-					break;
-				}
-			}
-			crash_or_shutdown(true,id,m);
-			break;
-		default:
-			crash_or_shutdown(true,id,m);
-		}
+void coroutine_example(){
+	auto client=spawn_properator<FactorialClient>();
+	auto fact=spawn_properator<FactorialCalculator>();
+	auto printer=spawn_properator<MessageLogger>();
+	make_channel<BasicChannel>({client,2,fact,1});
+	make_channel<BasicChannel>({fact,1,client,2});
+	make_channel<BasicChannel>({client,1,printer,1});
+	for(int n:{3,5,7})
+		post(0,0,client,1,Message({n}));
+	run_until_quiescent();
+	std::vector<UID> all{client,fact,printer};
+	crash_or_shutdown(false,all,Message({"Example Over"}));
+	run_until_quiescent();
+}
+
+// Checkpoint Example
+void checkpoint_example(){
+	restorable<FactorialCalculator>();
+	auto fact = spawn_properator<FactorialCalculator>();
+	auto printer = spawn_properator<MessageLogger>();
+	make_channel<BasicChannel>({fact,1,printer,1});
+	post(0,0,fact,1,Message({6}));
+	RunLimits limits;
+	limits.steps=4;
+	run_until_quiescent(limits);
+	// What's left to do is on the channels, so the snapshot carries it.
+	auto snapshot=checkpoint();
+	printf("Checkpoint of %zu bytes\n",snapshot.size());
+	std::vector<UID> both{fact,printer};
+	crash_or_shutdown(false,both,Message({"Checkpointed"}));
+	run_until_quiescent();
+	if(!restore(snapshot))
+		printf("Restore failed\n");
+	run_until_quiescent();
+	crash_or_shutdown(false,both,Message({"Example Over"}));
+	run_until_quiescent();
+}
+
+// Record and Replay Example
+void replay_example(){
+	auto fact = spawn_properator<FactorialCalculator>();
+	auto printer = spawn_properator<MessageLogger>();
+	make_channel<BasicChannel>({fact,1,printer,1});
+	post(0,0,fact,1,Message({4}));
+	// Recorded over two threads, replayed over one.
+	auto start=checkpoint();
+	start_recording();
+	run(2);
+	auto trace=stop_recording();
+	std::vector<UID> both{fact,printer};
+	crash_or_shutdown(false,both,Message({"Recorded"}));
+	run_until_quiescent();
+	restore(start);
+	if(auto r=replay(trace))
+		printf("Replayed %lu deliveries\n",r.steps);
+	crash_or_shutdown(false,both,Message({"Example Over"}));
+	run_until_quiescent();
+}
+
+// Lock Free Channel Example
+void lock_free_example(unsigned threads){
+	std::vector<UID> relays;
+	for(int i=0;i<8;i++)
+		relays.push_back(spawn_properator<Relay>());
+	for(size_t i=0;i+1<relays.size();i++)
+		make_channel<SPSCChannel<>>({relays[i],1,relays[i+1],1});
+	auto printer = spawn_properator<MessageLogger>();
+	make_channel<MPSCChannel<>>({relays.back(),1,printer,1});
+	for(std::string s:{"one","two","three"})
+		post(0,0,relays.front(),1,Message({s}));
+	run(threads);
+	#ifdef METRICS
+	metrics_dump();
+	#endif
+	crash_or_shutdown(false,printer,Message({"Example Over"}));
+	for(auto r:relays)
+		crash_or_shutdown(false,r,Message({"Example Over"}));
+	run(threads);
+}
+
+// Supervision Example
+// Passes numbers along, but can't cope with 13.
+struct Superstitious:TypedProperator<Superstitious,In<1,int>,Out<1,int>>{
+	Superstitious(UID id):TypedProperator(id){}
+	void on(In<1,int>,int n){
+		if(n==13)
+			crash_or_shutdown(true,id,Message({n}));
+		else
+			emit<1>(n);
 	}
 };
-struct SudokuValueAtLeastOnce:Properator{
-	std::vector<UID> cells;
-	std::map<UID,bool[9]> states;
-	SudokuValueAtLeastOnce(UID id):Properator(id){}
-	void receive(Message m, uint port,UID from,uint,std::shared_ptr<Properator>){
-		switch(port){
-		case 0:
-			// ["Add Cell", UID]
-			// ["Shutting Down" . TAIL]
-			if(std::holds_alternative<std::vector<Message>>(m.body)){
-				auto v = std::get<std::vector<Message>>(m.body);
-				if(v.size()==2)
-					if(std::holds_alternative<std::string>(v[0].body)){
-						auto vv = std::get<std::string>(v[0].body);
-						if(vv=="Add Cell")
-							if(std::holds_alternative<UID>(v[1].body)){
-								auto c=std::get<UID>(v[1].body);
-								cells.push_back(c);
-								if(cells.size()>9)
-									crash_or_shutdown(true,id,Message({std::vector<Message>({
-														Message({"Too many sub-cells: "s+std::to_string(cells.size())}),
-														m})}));
-								for(int i=0;i<9;i++)
-									states[c][i]=true;
-								make_channel<BasicChannel>({id,1,c,1});
-								make_channel<OnlyLatests>({c,1,id,1});
-								post(id,1,c,1,Message({"Query"}));
-								break;
-							}
-					}
-				if(v.size())
-					if(std::holds_alternative<std::string>(v[0].body)){
-						auto vv = std::get<std::string>(v[0].body);
-						if(vv=="Shutting Down")
-							break;}}
-			crash_or_shutdown(true,id,m);
-			break;
-		case 1:
-			// message::[current_state]
-			if(std::holds_alternative<std::vector<Message>>(m.body)){
-				auto v = std::get<std::vector<Message>>(m.body);
-				if(v.size()==9){
-					for(int val=0;val<9;val++)
-						if(!std::holds_alternative<int>(v[val].body))
-							crash_or_shutdown(true,id,m);
-						else
-							if(states[from][val]!=std::get<int>(v[val].body)){
-								states[from][val]=std::get<int>(v[val].body);
-								int found=0;
-								for(auto cell:cells)
-									if(states[cell][val])
-										found++;
-								if(found==1)
-									for(auto cell:cells)
-										if(states[cell][val])
-											post(id,1,cell,1,Message({std::vector<Message>({
-																Message({"Set"}),
-																Message({val+1})})}));
-							}
-					break;
-				}
-			}
-			crash_or_shutdown(true,id,m);
-			break;
-		default:
-			crash_or_shutdown(true,id,m);
-		}
+void supervision_example(){
+	SupervisorSpec spec;
+	spec.strategy=Restart::OneForOne;
+	spec.intensity=3;
+	auto sup = spawn_supervisor(spec);
+	auto s = spawn_child<Superstitious>(sup);
+	auto printer = spawn_properator<MessageLogger>();
+	make_channel<BasicChannel>({s,1,printer,1});
+	// The crash is healed, the printer never notices.
+	for(int n:{12,13,14}){
+		post(0,0,s,1,Message({n}));
+		run_until_quiescent();
 	}
-};
-struct SudokuGridDisplay:Properator{
-	std::vector<UID> cells;
-	std::map<UID,int> values;
-	SudokuGridDisplay(UID id):Properator(id){}
-	void receive(Message m, uint port,UID from,uint,std::shared_ptr<Properator>){
-		switch(port){
-			case 0:
-			if(std::holds_alternative<std::vector<Message>>(m.body)){
-				auto v = std::get<std::vector<Message>>(m.body);
-				if(v.size()==2)
-					if(std::holds_alternative<std::string>(v[0].body)){
-						auto vv = std::get<std::string>(v[0].body);
-						if(vv=="Add Cell")
-							if(std::holds_alternative<UID>(v[1].body)){
-								auto c=std::get<UID>(v[1].body);
-								cells.push_back(c);
-								if(cells.size()>81)
-									crash_or_shutdown(true,id,m); // TODO: Elaborate
-								values[c]=0;
-								make_channel<OnlyLatests>({id,1,c,1});
-								make_channel<OnlyLatests>({c,1,id,1});
-								post(id,1,c,1,Message({"Query"}));
-								break;
-							}
-					}
-				if(v.size())
-					if(std::holds_alternative<std::string>(v[0].body)){
-						auto vv = std::get<std::string>(v[0].body);
-						if(vv=="Shutting Down")
-							break;}}
-			// if cell crash or shutdown, crash
-			// might change later with an actual grid rather than just a list of cells
-			crash_or_shutdown(true,id,m);
-			break;
-		case 1:
-			if(std::holds_alternative<std::string>(m.body)){
-				auto v = std::get<std::string>(m.body);
-				if(v=="Display"){
-					if(cells.size()!=81){
-						crash_or_shutdown(true,id,m); // TODO: Elaborate
-						break;}
-					printf("\n");
-					for(int row=0;row<9;row++){
-						if(row==3 or row==6)
-							printf("---+---+---\n");
-						for(int col=0;col<9;col++){
-							auto val=values[cells[row*9+col]];
-							if(col==3 or col==6)
-								printf("|");
-							if(val)
-								printf("%d",val);
-							else
-								printf("_");}
-						printf("\n");}
-					break;
-				}
-			}else if(std::holds_alternative<std::vector<Message>>(m.body)){
-				auto v = std::get<std::vector<Message>>(m.body);
-				if(v.size()==9){
-					int found=0;
-					for(int val=0;val<9;val++)
-						if(!std::holds_alternative<int>(v[val].body))
-							crash_or_shutdown(true,id,m);
-						else
-							if(std::get<int>(v[val].body))
-								if(!found)
-									found=val+1;
-								else{
-									found=0;
-									break;}
-					values[from]=found;
-					// Assert that that's an increase
-					// assert that from was already in the map
-					break;
-				}
-			}
-			crash_or_shutdown(true,id,m);
-			break;
-		default:
-			crash_or_shutdown(true,id,m);
-		}
+	// Three more crashes and it's one restart too many, the printer
+	// hears about the crash and crashes in turn.
+	for(int i=0;i<3;i++){
+		post(0,0,s,1,Message({13}));
+		run_until_quiescent();
+	}
+	crash_or_shutdown(false,printer,Message({"Example Over"}));
+	run_until_quiescent();
+}
+
+// Backpressure Example
+void backpressure_example(){
+	auto printer = spawn_properator<MessageLogger>();
+	make_channel<BoundedChannel<2,Overflow::DropNewest>>({0,0,printer,1});
+	for(int n=1;n<=4;n++)
+		if(!post(0,0,printer,1,Message({n})))
+			printf("%d was dropped\n",n);
+	run_until_quiescent();
+	crash_or_shutdown(false,printer,Message({"Example Over"}));
+	run_until_quiescent();
+}
+
+// Blocking Example
+// A producer fills a channel that blocks when it's full.  Its consumer
+// started it, and shuts down once the channel is full without taking
+// anything, so the producer is left waiting for room.  It waits without
+// holding up the shutdown, then gives up as there's nobody left.
+struct Producer:Properator{
+	Producer(UID id):Properator(id){}
+	void receive(Message, uint port,UID,uint,std::shared_ptr<Properator>){
+		if(port!=1) return;
+		int n=1;
+		while(n<=10 and post(id,1,Message({n})))
+			n++;
+		if(n<=10)
+			printf("Producer gave up at %d\n",n);
 	}
 };
-#ifdef DEBUG
-struct SudokuGridVerboseDisplay:Properator{
-	std::vector<UID> cells;
-	std::map<UID,bool[9]> values;
-	SudokuGridVerboseDisplay(UID id):Properator(id){}
-	void receive(Message m, uint port,UID from,uint,std::shared_ptr<Properator>){
-		auto display=[&](){
-			printf("\n");
-			for(size_t row=0;row<9;row++){
-				if(row==3 or row==6)
-					printf("---+---+---+++---+---+---+++---+---+---\n\n");
-				for(size_t sub_row=0;sub_row<3;sub_row++){
-					for(size_t col=0;col<9;col++){
-						if(col==3 or col==6)
-							printf("| ");
-						for(size_t sub_col=0;sub_col<3;sub_col++){
-							auto val=3*sub_row+sub_col;
-							bool has=true;
-							if(cells.size()>row*9+col)
-								has=values[cells[row*9+col]][val];
-							if(has)
-								printf("%d",val+1);
-							else
-								printf("_");}
-						printf(" ");}
-					printf("\n\n");}}
-			printf("\n\n---\n");
-		};
-		switch(port){
-			case 0:
-			if(std::holds_alternative<std::vector<Message>>(m.body)){
-				auto v = std::get<std::vector<Message>>(m.body);
-				if(v.size()==2)
-					if(std::holds_alternative<std::string>(v[0].body)){
-						auto vv = std::get<std::string>(v[0].body);
-						if(vv=="Add Cell")
-							if(std::holds_alternative<UID>(v[1].body)){
-								auto c=std::get<UID>(v[1].body);
-								cells.push_back(c);
-								if(cells.size()>81)
-									crash_or_shutdown(true,id,m); // TODO: Elaborate
-								for(int val=0;val<9;val++)
-									values[c][val]=true;
-								make_channel<BasicChannel>({id,1,c,1});
-								make_channel<BasicChannel>({c,1,id,1});
-								post(id,1,c,1,Message({"Query"}));
-								break;
-							}
-					}
-				if(v.size())
-					if(std::holds_alternative<std::string>(v[0].body)){
-						auto vv = std::get<std::string>(v[0].body);
-						if(vv=="Shutting Down")
-							break;
-						if(vv=="Crashed") // Don't die on crashes, I need the logging
-							break;}}
-			crash_or_shutdown(true,id,m);
-			break;
-		case 1:
-			if(std::holds_alternative<std::string>(m.body)){
-				auto v = std::get<std::string>(m.body);
-				if(v=="Display"){
-					if(cells.size()!=81){
-						crash_or_shutdown(true,id,m); // TODO: Elaborate
-						break;}
-					display();
-					break;
-				}
-			}else if(std::holds_alternative<std::vector<Message>>(m.body)){
-				auto v = std::get<std::vector<Message>>(m.body);
-				if(v.size()==9){
-					int changed=0;
-					for(int val=0;val<9;val++)
-						if(!std::holds_alternative<int>(v[val].body))
-							crash_or_shutdown(true,id,m);
-						else
-							if((changed=(values[from][val]!=std::get<int>(v[val].body))))
-								values[from][val]=std::get<int>(v[val].body);
-					if(changed)
-						display();
-					break;
-				}
+struct Consumer:Properator{
+	std::shared_ptr<Channel> in;
+	Consumer(UID id):Properator(id){}
+	void receive(Message, uint port,UID,uint,std::shared_ptr<Properator>){
+		if(port!=1) return;
+		post(id,2,Message({"Go"}));
+		// Under its lock, as the producer's filling it.
+		for(;;){
+			{
+				std::lock_guard g(in->lock);
+				if(in->size()>=2) break;
 			}
-			crash_or_shutdown(true,id,m);
-			break;
-		default:
-			crash_or_shutdown(true,id,m);
+			std::this_thread::yield();
 		}
+		// Give the producer time to find it full.
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		printf("Consumer is shutting down\n");
+		crash_or_shutdown(false,id,Message({"Had enough"}));
 	}
 };
-#endif
-void sudoku_solver(int initial[9][9]){
-	std::vector<UID> cells;
-	for(int row=0;row<9;row++)
-		for(int col=0;col<9;col++){
-			cells.push_back(spawn_properator<SudokuCell>());
-			if(initial[row][col])
-				post(0,0,cells.back(),1,Message({std::vector<Message>({Message({"Set"}),Message({initial[row][col]})})}));
-		}
-
-	auto displayer=spawn_properator<SudokuGridDisplay>();
-	for(auto&c:cells)
-		post(0,0,displayer,0,Message(std::vector<Message>({
-							Message({"Add Cell"}),
-							Message({c})})));
+void blocking_example(unsigned threads){
+	auto producer=spawn_properator<Producer>();
+	auto consumer=std::make_shared<Consumer>(new_uid());
+	register_properator(consumer);
+	make_channel<BasicChannel>({consumer->id,2,producer,1});
+	consumer->in=make_channel<BoundedChannel<2,Overflow::Block>>({producer,1,consumer->id,1});
+	post(0,0,consumer->id,1,Message({"Go"}));
+	run(threads);
+	crash_or_shutdown(false,producer,Message({"Example Over"}));
+	run_until_quiescent();
+}
 
-	#ifdef DEBUG
-	auto displayerv=spawn_properator<SudokuGridVerboseDisplay>();
-	for(auto&c:cells)
-		post(0,0,displayerv,0,Message(std::vector<Message>({
-							Message({"Add Cell"}),
-							Message({c})})));
-	#endif
-	
-	// make the onehots
-	std::vector<UID> one_hots;
-	//printf("- Make the rows\n");
-	for(int row=0;row<9;row++){
-		one_hots.push_back(spawn_properator<SudokuValueAtMostOnce>());
-		for(int col=0;col<9;col++)
-			post(0,0,one_hots.back(),0,Message({std::vector<Message>({
-								Message({"Add Cell"}),
-								Message({cells[row*9+col]})})}));
-		one_hots.push_back(spawn_properator<SudokuValueAtLeastOnce>());
-		for(int col=0;col<9;col++)
-			post(0,0,one_hots.back(),0,Message({std::vector<Message>({
-								Message({"Add Cell"}),
-								Message({cells[row*9+col]})})}));
+// Timer Example
+// Counts down on every tick and then stops itself, which stops the
+// ticks.  The run sleeps in between.
+struct Countdown:Properator{
+	int left=3;
+	Countdown(UID id):Properator(id){}
+	void receive(Message, uint port,UID,uint,std::shared_ptr<Properator>){
+		if(port!=1) return;
+		if(left)
+			post(id,1,Message({left--}));
+		else
+			crash_or_shutdown(false,id,Message({"Liftoff"}));
 	}
+};
+void timer_example(){
+	auto countdown=spawn_properator<Countdown>();
+	auto printer=spawn_properator<MessageLogger>();
+	make_channel<BasicChannel>({countdown,1,printer,1});
+	post_every(std::chrono::milliseconds(10),0,0,countdown,1,Message({"Tick"}));
+	auto start=std::chrono::steady_clock::now();
+	run_until_quiescent();
+	if(std::chrono::steady_clock::now()-start>=std::chrono::milliseconds(40))
+		printf("Took four ticks\n");
+	crash_or_shutdown(false,printer,Message({"Example Over"}));
+	run_until_quiescent();
+}
 
-	//printf("- Make the cols\n");
-	for(int col=0;col<9;col++){
-		one_hots.push_back(spawn_properator<SudokuValueAtMostOnce>());
-		for(int row=0;row<9;row++)
-			post(0,0,one_hots.back(),0,Message({std::vector<Message>({
-								Message({"Add Cell"}),
-								Message({cells[row*9+col]})})}));
-		one_hots.push_back(spawn_properator<SudokuValueAtLeastOnce>());
-		for(int row=0;row<9;row++)
-			post(0,0,one_hots.back(),0,Message({std::vector<Message>({
-								Message({"Add Cell"}),
-								Message({cells[row*9+col]})})}));
+// Short and long timers together.  Each round sets long timers, which
+// wait a level up the wheel, and a short one that sets another due after
+// them, so there's something at the bottom while they wait to be moved
+// down.  Rounds start at different points in the wheel's turn, so some
+// long timer has to be caught on its way down.  None should be late, and
+// the cancelled one shouldn't come at all.
+struct Alarms:Properator{
+	int rounds=3;
+	std::chrono::steady_clock::time_point start;
+	std::chrono::milliseconds worst{0};
+	Alarms(UID id):Properator(id){}
+	void round(){
+		start=std::chrono::steady_clock::now();
+		for(int ms:{66,72,80,30})
+			post_after(std::chrono::milliseconds(ms),0,0,id,1,Message({ms}));
+		cancel_timer(post_after(std::chrono::milliseconds(50),0,0,id,1,Message({50})));
 	}
-
-	//printf("- Make the boxes\n");
-	for(int box=0;box<9;box++){
-		auto
-			r_min=3*(box/3),
-			c_min=3*(box%3);
-		one_hots.push_back(spawn_properator<SudokuValueAtMostOnce>());
-		for(int row=r_min;row<r_min+3;row++)
-			for(int col=c_min;col<c_min+3;col++)
-				post(0,0,one_hots.back(),0,Message({std::vector<Message>({
-									Message({"Add Cell"}),
-									Message({cells[row*9+col]})})}));
-		one_hots.push_back(spawn_properator<SudokuValueAtLeastOnce>());
-		for(int row=r_min;row<r_min+3;row++)
-			for(int col=c_min;col<c_min+3;col++)
-				post(0,0,one_hots.back(),0,Message({std::vector<Message>({
-									Message({"Add Cell"}),
-									Message({cells[row*9+col]})})}));
+	void receive(Message m, uint port,UID,uint,std::shared_ptr<Properator>){
+		if(port!=1 or !std::holds_alternative<int>(m.body)) return;
+		int ms=std::get<int>(m.body);
+		auto took=std::chrono::floor<std::chrono::milliseconds>(std::chrono::steady_clock::now()-start);
+		worst=std::max(worst,took-std::chrono::milliseconds(ms));
+		printf("%d ms%s",ms,ms==90?"\n":", ");
+		if(ms==30)
+			post_after(std::chrono::milliseconds(60),0,0,id,1,Message({90}));
+		else if(ms==90 and --rounds)
+			round();
 	}
+};
+void mixed_timer_example(){
+	auto alarms=std::make_shared<Alarms>(new_uid());
+	register_properator(alarms);
+	alarms->round();
+	run_until_quiescent();
+	if(alarms->worst<std::chrono::milliseconds(10))
+		printf("None late\n");
+	else
+		printf("Up to %ld ms late\n",long(alarms->worst.count()));
+	crash_or_shutdown(false,alarms->id,Message({"Example Over"}));
+	run_until_quiescent();
+}
 
-	while(main_loop_step());
-	post(0,0,displayer,1,Message({"Display"}));
-	while(main_loop_step());
-
-	for(auto&c:cells)
-		crash_or_shutdown(false,c,Message({"Example Over"}));
-	crash_or_shutdown(false,displayer,Message({"Example Over"}));
+// Distributed Example
+// Node 1 is a forked process, joined to this one by a socket pair.
+void distributed_example(){
+	auto printer = spawn_properator<MessageLogger>();
+	int fds[2];
+	if(socketpair(AF_UNIX,SOCK_STREAM,0,fds)){
+		printf("No socket pair\n");
+		return;}
+	fflush(stdout);
+	pid_t child=fork();
+	if(child==0){
+		// Starts with a copy of node 0's graph, and keeps none of it.
+		close(fds[0]);
+		crash_or_shutdown(false,printer,Message({"Not mine"}));
+		run_until_quiescent();
+		set_node(1);
+		connect_node(0,fds[1]);
+		auto relay = spawn_properator<Relay>();
+		make_channel<RemoteChannel>({relay,1,printer,1});
+		post(0,0,relay,1,Message({"Hello from node 1"}));
+		run_until_quiescent();
+		// The printer hears about it over the socket and crashes too.
+		crash_or_shutdown(true,relay,Message({"Node 1 is done"}));
+		run_until_quiescent();
+		fflush(stdout);
+		_exit(0);
+	}
+	close(fds[1]);
+	connect_node(1,fds[0]);
+	waitpid(child,nullptr,0);
+	run_until_quiescent();
+}
 
-	while(main_loop_step());
+// Wire Format Example
+// Every kind of message is encoded and decoded again, and read in
+// place through a MessageView, and has to come out the same every
+// way.  Encodings that are cut short, run on or are damaged have to
+// be refused rather than misread.
+bool same(Message const&a,Message const&b){
+	if(a.body.index()!=b.body.index()) return false;
+	return std::visit([&](auto const&x){
+		typedef std::decay_t<decltype(x)> T;
+		auto const& y=std::get<T>(b.body);
+		if constexpr(std::is_same_v<T,Tuple>){
+			if(x.size()!=y.size()) return false;
+			for(size_t i=0;i<x.size();i++)
+				if(!same(x[i],y[i])) return false;
+			return true;
+		}else
+			return x==y;
+	},a.body);
+}
+bool same(MessageView v,Message const&m){
+	return std::visit([&](auto const&x){
+		typedef std::decay_t<decltype(x)> T;
+		if constexpr(std::is_same_v<T,int>) return v.as_int()==x;
+		else if constexpr(std::is_same_v<T,float>) return v.as_float()==x;
+		else if constexpr(std::is_same_v<T,std::string>) return v.tag()==Wire::String and v.as_string()==x;
+		else if constexpr(std::is_same_v<T,Symbol>) return v.tag()==Wire::Symbol and v.as_string()==x.name();
+		else if constexpr(std::is_same_v<T,UID>) return v.as_uid()==x;
+		else if constexpr(std::is_same_v<T,LinkSpec>) return v.as_link()==x;
+		else{
+			if(v.tag()!=Wire::Tuple or v.size()!=x.size()) return false;
+			for(size_t i=0;i<x.size();i++)
+				if(!same(v[i],x[i])) return false;
+			return true;
+		}
+	},m.body);
 }
-void sudoku_example(){
+void wire_example(){
+	Message const kinds[]={
+		Message({7}),Message({-1}),Message({2.5f}),Message({std::string("text")}),
+		Message({std::string()}),Message({Symbol("Wire")}),Message({UID(1)<<40}),
+		Message({LinkSpec{1,2,3,4}}),Message({Tuple{}}),Message({Tuple{{1},{2}}}),
+		Message({Tuple{{Symbol("Add Cell")},{UID(42)},{Tuple{{1.5f},{std::string("nested")}}}}})};
+	int bad=0;
+	auto check=[&](bool ok,char const* what,size_t i){
+		if(!ok){
+			printf("Message %zu: %s\n",i,what);
+			bad++;}
+	};
+	for(size_t i=0;i<std::size(kinds);i++){
+		auto const& m=kinds[i];
+		std::vector<std::byte> e;
+		encode(m,e);
+		auto d=decode(e);
+		check(d and same(*d,m),"doesn't decode the same",i);
+		auto v=MessageView::of(e);
+		check(v.bytes()==e.size()-1,"has the wrong length in place",i);
+		check(same(v,m),"reads differently in place",i);
+		auto mv=v.materialize();
+		check(mv and same(*mv,m),"materializes differently",i);
+		for(size_t n=0;n<e.size();n++)
+			check(!decode(std::span(e).first(n)),"decodes cut short",i);
+		auto longer=e;
+		longer.push_back(std::byte(0));
+		check(!decode(longer),"decodes with a byte left over",i);
+		auto version=e;
+		version[0]=std::byte(wire_version+1);
+		check(!decode(version) and MessageView::of(version).empty(),"decodes with the wrong version",i);
+		auto tag=e;
+		tag[1]=std::byte(0x7F);
+		check(!decode(tag),"decodes with a made up tag",i);
+		if(std::holds_alternative<Tuple>(m.body)){
+			auto count=e; // After the version and tag
+			count[2]=std::byte(uint8_t(count[2])+1);
+			check(!decode(count),"decodes with the wrong count",i);}
+	}
+	printf("%zu kinds of message, %d problems\n",std::size(kinds),bad);
+}
+
+// Sudoku Example
+void sudoku_example(unsigned threads){
 	// Perform four easy puzzles to watch this work.
 	int grid1[9][9]={{5,0,0, 4,6,7, 3,0,9},
 									 {9,0,3, 8,1,0, 4,2,7},
@@ -638,7 +480,7 @@ void sudoku_example(){
 									 {0,0,0, 0,8,9, 2,6,0},
 									 {7,8,2, 6,4,1, 0,0,5},
 									 {0,1,0, 0,0,0, 7,0,8}};
-	sudoku_solver(grid1);
+	sudoku_solver(grid1,threads,true);
 
 	int grid2[9][9]={{5,0,0, 0,1,0, 0,0,4},
 									 {2,7,4, 0,0,0, 6,0,0},
@@ -651,7 +493,7 @@ void sudoku_example(){
 									 {0,0,0, 5,0,3, 0,1,0},
 									 {0,0,5, 0,0,0, 9,2,7},
 									 {1,0,0, 0,2,0, 0,0,3}};
-	sudoku_solver(grid2);
+	sudoku_solver(grid2,threads,true);
 
 	// Needs "only available" logic (e.g. There's only one available place for 6 in this row.)
 	int grid3[9][9]={{0,8,0, 6,0,0, 0,1,0},
@@ -665,7 +507,7 @@ void sudoku_example(){
 									 {0,0,0, 0,0,0, 8,0,0},
 									 {7,1,3, 4,0,0, 0,0,0},
 									 {0,5,0, 0,0,9, 0,3,0}};
-	sudoku_solver(grid3);
+	sudoku_solver(grid3,threads,true);
 
 	int grid4[9][9]={{0,0,0, 0,0,0, 0,0,0},
 									 {8,3,0, 1,5,0, 0,7,4},
@@ -678,7 +520,51 @@ void sudoku_example(){
 									 {7,8,6, 0,0,0, 0,1,2},
 									 {0,0,1, 0,0,8, 0,0,0},
 									 {0,0,4, 2,0,0, 0,0,0}};
-	sudoku_solver(grid4);
+	sudoku_solver(grid4,threads,true);
+}
+
+// Search Example
+void search_example(){
+	// Propagation alone gets nowhere with this one.
+	int grid[9][9]={{8,0,0, 0,0,0, 0,0,0},
+									{0,0,3, 6,0,0, 0,0,0},
+									{0,7,0, 0,9,0, 2,0,0},
+									// -------------------
+									{0,5,0, 0,0,7, 0,0,0},
+									{0,0,0, 0,4,5, 7,0,0},
+									{0,0,0, 1,0,0, 0,3,0},
+									// -------------------
+									{0,0,1, 0,0,0, 0,6,8},
+									{0,0,8, 5,0,0, 0,1,0},
+									{0,9,0, 0,0,0, 4,0,0}};
+	if(!sudoku_search(grid,true))
+		printf("No solution\n");
+}
+
+// Domain Kernels Example
+// The vector kernels, whichever this was built with, have to agree
+// with the plain loops on random groups.  Most cells are picked from a
+// few pairs and singles so there are clashes and naked pairs to find.
+// `make check_native' runs this with AVX2 where the machine has it.
+void domain_kernels_example(){
+	std::mt19937 random(42);
+	Domain const common[]={0x3,0x3,0x6,0x6,0x11,0x1,0x4,0x80};
+	int groups=0,differ=0;
+	for(size_t n=0;n<=64;n++)
+		for(int round=0;round<50;round++,groups++){
+			Domain d[64];
+			for(size_t i=0;i<n;i++)
+				d[i]=random()%3?common[random()%std::size(common)]:Domain(random());
+			auto a=scan_group(d,n),b=domain_detail::scan_scalar(d,n);
+			NakedPair pa[32],pb[32];
+			size_t na=naked_pairs(d,n,pa),nb=domain_detail::naked_pairs_scalar(d,n,pb);
+			bool same=a.any==b.any and a.hidden==b.hidden and a.fixed==b.fixed and
+				a.clash==b.clash and na==nb;
+			for(size_t i=0;same and i<na;i++)
+				same=pa[i].values==pb[i].values and pa[i].cells==pb[i].cells;
+			differ+=!same;
+		}
+	printf("%d groups, %d where the kernels and the plain loops differ\n",groups,differ);
 }
 
 int main(){
@@ -686,7 +572,35 @@ int main(){
 	hello_example();
 	printf("\n\nFactorial Example\n");
 	factorial_example();
+	printf("\n\nCoroutine Example\n");
+	coroutine_example();
+	printf("\n\nCheckpoint Example\n");
+	checkpoint_example();
+	printf("\n\nRecord and Replay Example\n");
+	replay_example();
+	printf("\n\nLock Free Channel Example\n");
+	lock_free_example(std::max(2u,std::thread::hardware_concurrency()));
+	printf("\n\nSupervision Example\n");
+	supervision_example();
+	printf("\n\nBackpressure Example\n");
+	backpressure_example();
+	printf("\n\nBlocking Example\n");
+	blocking_example(std::max(2u,std::thread::hardware_concurrency()));
+	printf("\n\nTimer Example\n");
+	timer_example();
+	printf("\n\nMixed Timer Example\n");
+	mixed_timer_example();
+	printf("\n\nDistributed Example\n");
+	distributed_example();
+	printf("\n\nWire Format Example\n");
+	wire_example();
 	printf("\n\nSudoku Example\n");
-	sudoku_example();
+	sudoku_example(1);
+	printf("\n\nParallel Sudoku Example\n");
+	sudoku_example(std::max(2u,std::thread::hardware_concurrency()));
+	printf("\n\nSearch Example\n");
+	search_example();
+	printf("\n\nDomain Kernels Example\n");
+	domain_kernels_example();
 }
 
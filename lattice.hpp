@@ -0,0 +1,110 @@
+#ifndef __LATTICE__
+#define __LATTICE__
+
+#include "typed.hpp"
+
+#include <deque>
+
+// Lattice Cells
+// A cell holds a value that only ever gains information.  Whatever
+// arrives on port 1 is joined in, and when that changes the value,
+// only what's new goes out on port 1.  Nothing is sent when nothing
+// changed, so a network of cells stops by itself at its fixpoint.
+// Reaching a contradiction crashes the cell.  The lattice is given by
+//   struct L{
+//     typedef ... value;          // Compared with ==, sent as Payload<value>
+//     static value bottom();      // Knowing nothing
+//     static value join(value const&,value const&);
+//     static bool contradiction(value const&);
+//     static value delta(value const&was,value const&is); // join(was,delta)==is
+//   };
+// Subscribers join the deltas into their own copy.  Sending the cell
+// `Query' on port 1 gets the whole value sent back to the asker, as a
+// delta from bottom.  Without Crash a contradiction is sent on like
+// any other value, for when it's only a failed guess (see search.hpp).
+
+template<typename L,bool Crash=true> struct LatticeCell:Properator{
+	typedef typename L::value value;
+	value v=L::bottom();
+	LatticeCell(UID _id):Properator(_id){}
+	// A whole batch is joined before anything is sent.
+	void receive_batch(std::span<Message> ms,uint port,UID from,uint from_port,std::shared_ptr<Properator> self)override{
+		if(port==0){
+			Properator::receive_batch(ms,port,from,from_port,std::move(self));
+			return;}
+		if(port!=1){ // Nothing else is listening
+			crash_or_shutdown(true,id,std::move(ms[0]));
+			return;}
+		value next=v;
+		for(auto&m:ms){
+			if(auto in=Payload<value>::from(m))
+				next=L::join(next,*in);
+			else if(is_query(m))
+				post(id,1,from,Payload<value>::to(L::delta(L::bottom(),next)));
+			else{
+				crash_or_shutdown(true,id,std::move(m));
+				return;}
+		}
+		update(std::move(next));
+	}
+	void receive(Message m,uint port,UID from,uint from_port,std::shared_ptr<Properator> self)override{
+		if(port==0){
+			if(auto t=std::get_if<Tuple>(&m.body);t and t->size())
+				if(auto head=(*t)[0];std::holds_alternative<Symbol>(head.body) and
+					 std::get<Symbol>(head.body)==ShuttingDown)
+					return;
+			crash_or_shutdown(true,id,std::move(m));
+			return;}
+		if(port!=1){
+			crash_or_shutdown(true,id,std::move(m));
+			return;}
+		receive_batch(std::span<Message>(&m,1),port,from,from_port,std::move(self));
+	}
+	void save(Writer& w) const override{w.message(Payload<value>::to(v));}
+	void load(Reader& r)override{
+		if(auto in=Payload<value>::from(r.message())) v=*in;
+		else r.ok=false;
+	}
+private:
+	static bool is_query(Message const&m){
+		auto s=std::get_if<Symbol>(&m.body);
+		return s and *s==Query;
+	}
+	void update(value next){
+		if(next==v) return;
+		if(Crash and L::contradiction(next)){
+			crash_or_shutdown(true,id,Payload<value>::to(next));
+			return;}
+		auto d=L::delta(v,next);
+		v=std::move(next);
+		post(id,1,Payload<value>::to(d));
+	}
+};
+
+// Queued deltas that are next to each other are joined into one, so
+// a slow subscriber gets fewer, bigger updates and never a stale one.
+template<typename L> struct JoinChannel:Channel{
+	typedef typename L::value value;
+	std::deque<Message> v;
+	JoinChannel(LinkSpec link):Channel(link){};
+	Posted offer(Message& m)override{
+		if(v.size())
+			if(auto in=Payload<value>::from(m))
+				if(auto last=Payload<value>::from(v.back())){
+					v.back()=Payload<value>::to(L::join(*last,*in));
+					return Posted::Displaced;}
+		v.push_back(std::move(m));
+		ready();
+		return Posted::Queued;
+	}
+	void send(Message m)override{offer(m);}
+	Message read()override{
+		auto m=std::move(v.front());
+		v.pop_front();
+		return m;
+	}
+	bool has_message() const override{return v.size();}
+	size_t size() const override{return v.size();}
+};
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef __METRICS__
+#define __METRICS__
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <deque>
+
+// Runtime counters and histograms.  Turn them on here or with
+// -DMETRICS, everything below compiles to nothing otherwise.  Both the
+// runtime and anything including properator.hpp have to agree.
+//#define METRICS 1
+#ifdef METRICS
+#define METRIC(X) do{X;}while(0)
+constexpr bool metrics_enabled=true;
+#else
+#define METRIC(X) do{}while(0)
+constexpr bool metrics_enabled=false;
+#endif
+
+// Power of two buckets of nanoseconds.
+struct Histogram{
+	static constexpr size_t buckets=40;
+	typedef std::array<unsigned long,buckets> Counts;
+	std::atomic<unsigned long> counts[buckets]{};
+	void add(unsigned long ns){
+		counts[std::min<size_t>(buckets-1,std::bit_width(ns))].fetch_add(1,std::memory_order_relaxed);}
+	Counts read() const{
+		Counts c;
+		for(size_t i=0;i<buckets;i++)
+			c[i]=counts[i].load(std::memory_order_relaxed);
+		return c;
+	}
+	// Upper bound of the bucket holding the p'th fraction of samples.
+	static unsigned long percentile(Counts const&c,double p){
+		unsigned long total=0,seen=0;
+		for(auto n:c) total+=n;
+		for(size_t i=0;i<buckets;i++)
+			if((seen+=c[i]) and seen>=p*total)
+				return 1ul<<i;
+		return 0;
+	}
+};
+
+struct ChannelMetrics{
+	std::atomic<unsigned long> sent=0,received=0,high_water=0;
+	Histogram dwell; // Time from send to being taken by the scheduler
+	std::deque<std::chrono::steady_clock::time_point> stamps; // Guarded by Channel::lock
+};
+struct ProperatorMetrics{
+	std::atomic<unsigned long> received=0,busy_ns=0;
+	Histogram busy; // Time per receive or receive_batch call
+};
+
+#endif
@@ -1,10 +1,22 @@
 #ifndef __PROPERATOR__
 #define __PROPERATOR__
 
+#include "metrics.hpp"
+
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <queue>
+#include <span>
 #include <string>
+#include <string_view>
+#include <typeinfo>
 #include <variant>
 #include <vector>
 
@@ -16,34 +28,158 @@ struct LinkSpec{
 	unsigned int from_port;
 	UID to;
 	unsigned int to_port;
+	bool operator==(LinkSpec const&) const=default;
+};
+// An interned string.  Use these for commands and tags, they compare
+// and copy as an integer.  Construct them once (e.g. as a static) and
+// not in the middle of a hot loop, construction is a table lookup.
+struct Symbol{
+	unsigned int id=0;
+	Symbol()=default;
+	explicit Symbol(std::string const&name);
+	std::string const& name() const;
+	bool operator==(Symbol const&) const=default;
+};
+// Reasons given to next of kin on port 0.
+extern Symbol const Crashed;
+extern Symbol const ShuttingDown;
+extern Symbol const NotFound;
+// {Credit,link,free} tells a sender that a full channel has room
+// again, only for channels that ask for it.
+extern Symbol const Credit;
+// Asks for a properator's whole state, see lattice.hpp.
+extern Symbol const Query;
+
+struct Message;
+// An immutable list of messages.  The elements are one shared block
+// from the pools, so copies only touch a reference count and indexing
+// hands out references.
+struct Tuple{
+	Tuple()=default;
+	Tuple(std::initializer_list<Message> l);
+	Tuple(std::vector<Message> const&v);
+	size_t size() const{return n;}
+	Message const& operator[](size_t i) const;
+	struct iterator{
+		Tuple const*t;
+		size_t i;
+		Message const& operator*() const;
+		iterator& operator++(){i++;return *this;}
+		bool operator==(iterator const&) const=default;
+	};
+	iterator begin() const{return {this,0};}
+	iterator end() const{return {this,n};}
+private:
+	template<typename It> void fill(It begin,It end,size_t size);
+	unsigned int n=0;
+	std::shared_ptr<Message const[]> heap;
 };
 struct Message{
-	// TODO: make this a std::any
-	std::variant<int,float,std::string,UID,LinkSpec,std::vector<Message>> body;
+	std::variant<int,float,std::string,Symbol,UID,LinkSpec,Tuple> body;
 };
-struct Channel{
+static_assert(sizeof(Message)<=64,"Messages should fit in a cache line.");
+inline Message const& Tuple::operator[](size_t i) const{return heap[i];}
+inline Message const& Tuple::iterator::operator*() const{return (*t)[i];}
+// What became of a posted message, the worst over every channel it
+// went to.  True if it was queued.
+struct Posted{
+	enum Status:unsigned char{
+		Queued,
+		Displaced, // Queued, but an older message was dropped or replaced
+		Dropped,   // Thrown away by a full channel that drops the newest
+		Full,      // Refused by a full channel that blocks
+		NoRoute,
+	} status;
+	Posted(Status s=Queued):status(s){}
+	operator bool() const{return status<=Displaced;}
+};
+struct Writer;
+struct Reader;
+struct Channel:std::enable_shared_from_this<Channel>{
 	LinkSpec info;
+	std::atomic<bool> scheduled=false; // Sitting on a ready list
+	std::atomic<bool> attached=true;   // Still routed, cleared by purge_channels
+	size_t slot=0; // Index in `channels', kept by the routing functions
+	size_t from_slot=0,link_slot=0,out_slot=0,in_slot=0; // And in its routes, likewise
+	std::atomic<unsigned> home=~0u; // Its receiver's worker, see Placement
+	std::atomic<unsigned long> traffic=0; // Messages taken, for partition()
+	// A fresh, empty channel for the same link.  Set by make_channel so
+	// supervisors can rebuild the links of the children they restart.
+	std::shared_ptr<Channel> (*remake)(LinkSpec)=nullptr;
+	std::mutex lock; // Held by the runtime around send and read
 	Channel(LinkSpec _info):info(_info){}
+	// Implementations call ready() after storing a message.
 	virtual void send(Message)=0;
 	virtual Message read()=0;
 	virtual bool has_message() const=0;
+	// Non-blocking and batched versions, override if there's a cheaper way.
+	virtual bool try_send(Message m);
+	// How the runtime sends.  Bounded channels say what their overflow
+	// policy did, and only move from `m' when it's kept.  A channel
+	// that's Full is retried while other workers can empty it.
+	virtual Posted offer(Message& m){send(std::move(m));return Posted::Queued;}
+	virtual std::optional<Message> try_read();
+	virtual size_t read_batch(std::vector<Message>& out,size_t max);
+	// Channels that synchronise themselves skip `lock'.
+	virtual bool lock_free() const{return false;}
+	// How many messages are waiting, for monitoring.
+	virtual size_t size() const{return has_message();}
+	// For checkpoints, see below.  By default what's queued is read
+	// out, written and sent again, and loading sends it.
+	virtual void save(Writer& w);
+	virtual void load(Reader& r);
 	virtual ~Channel()=default;
+	void ready(); // Put this on the scheduler's ready list
+#ifdef METRICS
+	ChannelMetrics metrics;
+#endif
 };
 struct Properator{ // propagator or operator
 	UID id;
+	std::mutex running; // At most one worker is in receive at a time
+	std::atomic<bool> alive=true; // Cleared by crash_or_shutdown
+	size_t slot=0; // Index in `properators', kept by the routing functions
+	unsigned home=~0u; // Worker it runs on by preference, see Placement
+#ifdef METRICS
+	ProperatorMetrics metrics;
+#endif
 	Properator(UID _id):id(_id){}
 	// Port 0 is for construction and system messages
 	// The self pointer is so that the cleanup happens after the function finishes.
 	virtual void receive(Message, uint port,UID from,uint from_port,std::shared_ptr<Properator> self)=0;
+	// Several messages from one channel, in order.  Override when it's
+	// cheaper to handle them together, by default it calls receive.
+	virtual void receive_batch(std::span<Message> ms,uint port,UID from,uint from_port,std::shared_ptr<Properator> self);
+	// Payload types of typed ports, nullptr for anything goes.  Checked
+	// when channels are made, see typed.hpp.
+	virtual std::type_info const* in_type(uint) const{return nullptr;}
+	virtual std::type_info const* out_type(uint) const{return nullptr;}
+	// State for checkpoints, see below.  Stateless properators needn't
+	// bother.
+	virtual void save(Writer&) const{}
+	virtual void load(Reader&){}
 	virtual ~Properator()=default;
 };
 
 extern std::vector<std::shared_ptr<Properator>> properators;
 extern std::vector<std::shared_ptr<Channel>> channels;
+// Add to the globals and the routing tables.  Channels between ports
+// with different payload types are refused.
+void register_properator(std::shared_ptr<Properator> p);
+// nullptr if there isn't one.
+std::shared_ptr<Properator> find_properator(UID id);
+bool register_channel(std::shared_ptr<Channel> c);
 
-bool post(UID from,uint from_port,Message message);
-bool post(UID from,uint from_port,UID to,Message message);
-bool post(UID from,uint from_port,UID to, uint to_port,Message message);
+Posted post(UID from,uint from_port,Message message);
+Posted post(UID from,uint from_port,UID to,Message message);
+Posted post(UID from,uint from_port,UID to, uint to_port,Message message);
+
+bool running_parallel();
+// Yield while a bounded channel is full.  False if nothing else is
+// running that could empty it.
+bool backoff();
+void drop_full(LinkSpec const&l); // Report a message lost to a full channel
+void flow_credit(LinkSpec const&l,size_t free); // Send the Credit notice
 
 struct BasicChannel:Channel{
 	std::queue<Message> v;
@@ -51,6 +187,7 @@ struct BasicChannel:Channel{
 	void send(Message m)override;
 	Message read()override;
 	bool has_message() const override;
+	size_t size() const override{return v.size();}
 };
 struct OnlyLatests:Channel{
 	std::optional<Message> v;
@@ -58,7 +195,163 @@ struct OnlyLatests:Channel{
 	void send(Message m)override;
 	Message read()override;
 	bool has_message() const override;
+	Posted offer(Message& m)override;
+};
+
+// Bounded Channels
+// What a full channel does with one more message.
+enum class Overflow{
+	Block,      // Refuse it, the sender yields and retries while others are running
+	DropOldest, // Make room at the front
+	DropNewest, // Throw the new one away
+	Coalesce,   // Replace the newest, like OnlyLatests
+};
+// A ring of Capacity messages.  With Credit the sender gets a Credit
+// notice on port 0 once a channel that overflowed is half empty.
+template<size_t Capacity,Overflow Policy=Overflow::Block,bool Credit=false>
+struct BoundedChannel:Channel{
+	static_assert(Capacity,"Capacity can't be zero");
+	Message slots[Capacity];
+	size_t head=0,count=0;
+	bool owed=false; // Overflowed since the last notice
+	BoundedChannel(LinkSpec link):Channel(link){};
+	Posted offer(Message& m)override{
+		Posted s=Posted::Queued;
+		if(count==Capacity){
+			owed=true;
+			switch(Policy){
+			case Overflow::Block: return Posted::Full;
+			case Overflow::DropNewest: return Posted::Dropped;
+			case Overflow::DropOldest: head=(head+1)%Capacity; count--; break;
+			case Overflow::Coalesce: count--; break;
+			}
+			s=Posted::Displaced;
+		}
+		slots[(head+count++)%Capacity]=std::move(m);
+		ready();
+		return s;
+	}
+	void send(Message m)override{
+		if(!offer(m)) drop_full(info);
+	}
+	std::optional<Message> try_read()override{
+		if(!count) return {};
+		Message m=std::move(slots[head]);
+		head=(head+1)%Capacity;
+		count--;
+		if(Credit and owed and count<=Capacity/2){
+			owed=false;
+			flow_credit(info,Capacity-count);}
+		return m;
+	}
+	Message read()override{return *try_read();}
+	bool has_message() const override{return count;}
+	size_t size() const override{return count;}
+};
+
+// Lock Free Channels
+// For edges that cross workers.  Reads only ever happen from one
+// worker at a time (the one running the receiving properator) so all
+// of these are single consumer.  A full ring blocks the sender while
+// other workers are running, otherwise the message is dropped.
+template<size_t Capacity=1024> struct SPSCChannel:Channel{
+	static_assert(Capacity and !(Capacity&(Capacity-1)),"Capacity must be a power of two");
+	Message slots[Capacity];
+	std::atomic<size_t> head=0,tail=0;
+	SPSCChannel(LinkSpec link):Channel(link){};
+	bool lock_free() const override{return true;}
+	// Only moves from `m' if there was room.
+	bool push(Message& m){
+		auto t=tail.load(std::memory_order_relaxed);
+		if(t-head.load(std::memory_order_acquire)==Capacity) return false;
+		slots[t%Capacity]=std::move(m);
+		tail.store(t+1);
+		ready();
+		return true;
+	}
+	bool try_send(Message m)override{return push(m);}
+	Posted offer(Message& m)override{return push(m)?Posted::Queued:Posted::Full;}
+	// The runtime sends with offer and does the waiting itself.
+	void send(Message m)override{
+		if(!push(m)) drop_full(info);
+	}
+	std::optional<Message> try_read()override{
+		auto h=head.load(std::memory_order_relaxed);
+		if(h==tail.load()) return {};
+		Message m=std::move(slots[h%Capacity]);
+		head.store(h+1,std::memory_order_release);
+		return m;
+	}
+	Message read()override{return *try_read();}
+	bool has_message() const override{return head.load(std::memory_order_relaxed)!=tail.load();}
+	size_t size() const override{return tail.load()-head.load();}
+};
+// Vyukov's bounded queue, with the consumer side simplified.
+template<size_t Capacity=1024> struct MPSCChannel:Channel{
+	static_assert(Capacity and !(Capacity&(Capacity-1)),"Capacity must be a power of two");
+	struct Cell{
+		std::atomic<size_t> sequence;
+		Message m;
+	} cells[Capacity];
+	std::atomic<size_t> enqueue_at=0;
+	size_t dequeue_at=0; // Only the consumer touches this
+	MPSCChannel(LinkSpec link):Channel(link){
+		for(size_t i=0;i<Capacity;i++)
+			cells[i].sequence.store(i,std::memory_order_relaxed);
+	};
+	bool lock_free() const override{return true;}
+	// Only moves from `m' if there was room.
+	bool push(Message& m){
+		auto pos=enqueue_at.load(std::memory_order_relaxed);
+		Cell* c;
+		while(true){
+			c=&cells[pos%Capacity];
+			auto seq=c->sequence.load(std::memory_order_acquire);
+			auto dif=std::ptrdiff_t(seq)-std::ptrdiff_t(pos);
+			if(dif==0){
+				if(enqueue_at.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed))
+					break;
+			}else if(dif<0)
+				return false;
+			else
+				pos=enqueue_at.load(std::memory_order_relaxed);
+		}
+		c->m=std::move(m);
+		c->sequence.store(pos+1);
+		ready();
+		return true;
+	}
+	bool try_send(Message m)override{return push(m);}
+	Posted offer(Message& m)override{return push(m)?Posted::Queued:Posted::Full;}
+	// The runtime sends with offer and does the waiting itself.
+	void send(Message m)override{
+		if(!push(m)) drop_full(info);
+	}
+	std::optional<Message> try_read()override{
+		auto& c=cells[dequeue_at%Capacity];
+		if(c.sequence.load()!=dequeue_at+1) return {};
+		Message m=std::move(c.m);
+		c.sequence.store(dequeue_at+Capacity,std::memory_order_release);
+		dequeue_at++;
+		return m;
+	}
+	Message read()override{return *try_read();}
+	bool has_message() const override{
+		return cells[dequeue_at%Capacity].sequence.load()==dequeue_at+1;}
+	size_t size() const override{return enqueue_at.load()-dequeue_at;}
+};
+// OnlyLatests for any number of senders.
+struct AtomicLatests:Channel{
+	std::atomic<Message*> v=nullptr;
+	AtomicLatests(LinkSpec link):Channel(link){};
+	~AtomicLatests(){delete v.load();}
+	bool lock_free() const override{return true;}
+	void send(Message m)override;
+	std::optional<Message> try_read()override;
+	Message read()override;
+	bool has_message() const override;
 };
+
 struct Relay:Properator{
 	std::string value;
 	Relay(UID id):Properator(id){}
@@ -69,20 +362,354 @@ struct MessageLogger:Properator{
 	void receive(Message m, uint port,UID from,uint from_port,std::shared_ptr<Properator>);
 };
 
+// Most messages handed over from one channel per scheduling decision.
+extern size_t batch_quantum;
 bool main_loop_step();// Return if did anything.  Only for example version.
+// Run until there's nothing left to do, spread over n_threads workers.
+// Don't touch `properators' or `channels' from outside while it runs.
+void run(unsigned n_threads);
+// Nothing left to do means the network has reached its fixpoint.
+// Knowing that costs nothing extra, and idle workers sleep rather than
+// spin.  A run that's stopped early can be carried on by another.
+struct RunLimits{
+	unsigned threads=1;
+	unsigned long steps=0; // Most messages or batches handed over, 0 for no limit
+	std::chrono::steady_clock::duration timeout{}; // Zero for no limit
+};
+struct RunResult{
+	enum Stop{
+		Quiescent,
+		OutOfSteps,
+		TimedOut,
+	} stop;
+	unsigned long steps;
+	operator bool() const{return stop==Quiescent;}
+};
+RunResult run_until_quiescent(RunLimits limits={});
 void crash_or_shutdown(bool crash,UID id,Message log_message);
+// Take a whole group down at once, costs O(edges removed).  Links
+// inside the group aren't reported to anyone.
+void crash_or_shutdown(bool crash,std::span<UID const> ids,Message log_message);
+
+// Placement
+// A properator can have a home worker.  While run() is going, a channel
+// with something to deliver is queued on its receiver's home, so
+// neighbours that talk a lot run on the same thread and what they pass
+// each other stays in its cache.  Idle workers still steal, homes only
+// say where work starts.  Without one, work stays on the worker that
+// made it.  Homes are taken modulo the number of workers.
+// partition() splits the graph into `parts' of about the same number
+// of properators, cutting as little as it can.  An edge weighs one
+// plus the messages taken off it lately; the counts are halved each
+// time, so the weights follow the traffic.  It's label propagation
+// starting from the current homes, where the unplaced are laid out in
+// breadth first order, so each properator moves to the part its edges
+// mostly go to if there's room.  Run again, it moves only those whose
+// traffic has changed.
+struct Placement{
+	std::vector<std::pair<UID,unsigned>> homes;
+	unsigned parts=0;
+	unsigned long cut=0,weight=0; // Of the edges between parts, and of them all
+};
+Placement partition(unsigned parts);
+void place(Placement const& p);
+// Partition for the workers at the start of every parallel run and
+// then every `period' while it goes, zero to stop.
+void place_every(std::chrono::milliseconds period);
+
+// Pools
+// Fixed size blocks carved out of chunks that double in size, so
+// building a graph is a handful of allocations rather than one per
+// node.  Freed blocks are kept on a free list for the next node of the
+// same type.  Types don't share blocks, so a thread checker never takes
+// one type's mutex for another's left at the same address.
+template<typename T> struct Slab{
+	union Block{
+		Block* next;
+		alignas(T) unsigned char bytes[sizeof(T)];
+	};
+	std::mutex lock;
+	Block* free=nullptr;
+	size_t next_chunk=16;
+	std::vector<std::unique_ptr<Block[]>> chunks;
+	void* allocate(){
+		std::lock_guard g(lock);
+		if(!free){
+			chunks.emplace_back(new Block[next_chunk]);
+			for(size_t i=0;i<next_chunk;i++){
+				chunks.back()[i].next=free;
+				free=&chunks.back()[i];}
+			next_chunk*=2;
+		}
+		auto b=free;
+		free=b->next;
+		return b;
+	}
+	void deallocate(void* p){
+		std::lock_guard g(lock);
+		auto b=static_cast<Block*>(p);
+		b->next=free;
+		free=b;
+	}
+	// Never destroyed, the global vectors may still be returning blocks
+	// during static destruction.
+	static Slab& instance(){
+		static Slab& s=*new Slab;
+		return s;
+	}
+};
+template<typename T> struct PoolAllocator{
+	typedef T value_type;
+	PoolAllocator()=default;
+	template<typename U> PoolAllocator(PoolAllocator<U> const&){}
+	// Short arrays, like a Tuple's elements, have a slab per length.
+	static constexpr size_t pooled=8;
+	T* allocate(size_t n){
+		if(n>pooled) return std::allocator<T>().allocate(n);
+		return static_cast<T*>(with_slab(n,[](auto& s){return s.allocate();}));
+	}
+	void deallocate(T* p,size_t n){
+		if(n>pooled) return std::allocator<T>().deallocate(p,n);
+		with_slab(n,[&](auto& s){s.deallocate(p);return nullptr;});
+	}
+	template<typename U> bool operator==(PoolAllocator<U> const&) const{return true;}
+private:
+	template<size_t N=1,typename F> static void* with_slab(size_t n,F f){
+		if constexpr(N<pooled)
+			if(n>N) return with_slab<N+1>(n,f);
+		return f(Slab<T[N]>::instance());
+	}
+};
 
 template<typename T> UID spawn_properator(){
 	// TODO: Constrain T to be a Properator.
 	UID id=new_uid();
-	auto p=std::make_shared<T>(id);
-	properators.push_back(p);
+	auto p=std::allocate_shared<T>(PoolAllocator<T>(),id);
+	register_properator(p);
 	return id;
 }
+template<typename T> std::shared_ptr<Channel> remake_channel(LinkSpec linkspec){
+	auto c=std::allocate_shared<T>(PoolAllocator<T>(),linkspec);
+	c->remake=&remake_channel<T>;
+	return c;
+}
+// nullptr if the ports' payload types don't match.
 template<typename T> std::shared_ptr<Channel> make_channel(LinkSpec linkspec){
 	// TODO: Constrain T to be a Channel.
-	auto c=std::make_shared<T>(linkspec);
-	channels.push_back(c);
+	auto c=remake_channel<T>(linkspec);
+	if(!register_channel(c)) return nullptr;
 	return c;
 }
+
+// Supervision
+// A supervisor restarts its children when they crash, under the same
+// UID and with fresh copies of their channels, so the rest of the
+// graph never hears about it.  Messages queued on those channels are
+// lost.  After more than `intensity' restarts within `period' it gives
+// up: its children are shut down and it crashes, which is then its own
+// supervisor's problem.  A child that shuts down normally just leaves.
+enum class Restart{
+	OneForOne,  // Only the crashed child
+	OneForAll,  // Every child
+	RestForOne, // The crashed child and those started after it
+};
+struct SupervisorSpec{
+	Restart strategy=Restart::OneForOne;
+	unsigned intensity=3;
+	std::chrono::steady_clock::duration period=std::chrono::seconds(5);
+	std::function<void(UID)> init; // Starts the children, run again on every restart
+};
+// With a parent the supervisor is that supervisor's child.
+UID spawn_supervisor(SupervisorSpec spec,UID parent=0);
+// 0 if `supervisor' isn't one.
+UID spawn_child(UID supervisor,std::function<std::shared_ptr<Properator>(UID)> make);
+template<typename T> UID spawn_child(UID supervisor){
+	return spawn_child(supervisor,[](UID id)->std::shared_ptr<Properator>{
+		return std::allocate_shared<T>(PoolAllocator<T>(),id);});
+}
+
+// Wire Format
+// How messages travel outside the process and sit in files.  A
+// standalone message is a version byte, then the message: a tag byte
+// and the value, little endian.  Strings and Symbols are a length and
+// the bytes (Symbols by name, their numbers differ from run to run),
+// LinkSpecs their four fields packed, and Tuples a count and their
+// length in bytes before the elements, so a reader can step over one
+// without looking inside.  A reader that doesn't know the version
+// refuses the message.
+static_assert(std::endian::native==std::endian::little,"The wire format is little endian.");
+constexpr uint8_t wire_version=1;
+namespace Wire{enum Tag:uint8_t{Int,Float,String,Symbol,UID,LinkSpec,Tuple};}
+struct Writer{
+	std::vector<std::byte>& out;
+	template<typename T> void pod(T const&v){
+		static_assert(std::is_trivially_copyable_v<T>);
+		auto b=reinterpret_cast<std::byte const*>(&v);
+		out.insert(out.end(),b,b+sizeof(T));
+	}
+	void string(std::string_view s);
+	void link(LinkSpec const&l);
+	void message(Message const&m); // Without the version
+};
+// Goes bad, and stays bad, on running off the end or nonsense.
+struct Reader{
+	std::span<std::byte const> in;
+	bool ok=true;
+	template<typename T> T pod(){
+		static_assert(std::is_trivially_copyable_v<T>);
+		T v{};
+		if(in.size()<sizeof(T)){
+			ok=false;
+			return v;}
+		memcpy(&v,in.data(),sizeof(T));
+		in=in.subspan(sizeof(T));
+		return v;
+	}
+	std::span<std::byte const> bytes(size_t n);
+	std::string string();
+	LinkSpec link();
+	Message message(); // Without the version
+};
+// Appends to `out' so a buffer can be reused.
+void encode(Message const&m,std::vector<std::byte>& out);
+std::optional<Message> decode(std::span<std::byte const> in);
+
+// Looks at an encoded message in place.  Nothing is copied or
+// allocated until materialize(); strings come back as views into the
+// bytes, which have to outlive them.  Anything malformed or of the
+// wrong kind reads as empty.
+struct MessageView{
+	std::span<std::byte const> b; // From the tag, may run on past the end
+	MessageView(std::span<std::byte const> _b={}):b(_b){}
+	// The message after a version byte, empty for the wrong version.
+	static MessageView of(std::span<std::byte const> encoded);
+	bool empty() const{return b.empty();}
+	Wire::Tag tag() const{return Wire::Tag(b[0]);}
+	size_t bytes() const; // Encoded length, 0 if malformed
+	std::optional<int> as_int() const;
+	std::optional<float> as_float() const;
+	std::optional<UID> as_uid() const;
+	std::optional<LinkSpec> as_link() const;
+	std::optional<std::string_view> as_string() const; // Strings and Symbol names
+	size_t size() const; // Elements of a Tuple
+	MessageView operator[](size_t i) const;
+	std::optional<Message> materialize() const;
+};
+
+// Checkpoints
+// A snapshot of the whole graph taken between runs: every properator
+// and its save(), every channel and what's queued on it, the system
+// messages waiting and the UID counter.  restore() adds it all back,
+// and fails without touching anything if a UID is already in use, so
+// it's for a fresh or emptied runtime (or a forked one).  A link whose
+// ports no longer have the same type is left out, with its messages,
+// and restore() returns false after adding the rest.  The layout
+// is a fixed header and length prefixed records, read in place from
+// the bytes given, so a file can be mapped and restored straight
+// from the page cache.
+// Properators and channels are remade by their kind, the name of
+// their type, which has to be registered with restorable<T>() first.
+// The builtin ones are.  Supervisors can't be checkpointed.
+void restorable_kind(std::string const&kind,std::shared_ptr<Properator>(*make)(UID));
+void restorable_kind(std::string const&kind,std::shared_ptr<Channel>(*make)(LinkSpec));
+template<typename T> std::shared_ptr<Properator> remake_properator(UID id){
+	return std::allocate_shared<T>(PoolAllocator<T>(),id);
+}
+template<typename T> void restorable(){
+	if constexpr(std::is_base_of_v<Channel,T>)
+		restorable_kind(typeid(T).name(),&remake_channel<T>);
+	else
+		restorable_kind(typeid(T).name(),&remake_properator<T>);
+}
+// Empty if anything in the graph isn't restorable.
+std::vector<std::byte> checkpoint();
+bool restore(std::span<std::byte const> snapshot);
+bool checkpoint(char const* path);
+bool restore(char const* path);
+
+// Record and Replay
+// While recording, every delivery the scheduler makes is appended to
+// a trace: who got it, over which link, and the messages, in the wire
+// format.  Replaying a trace makes the same deliveries in the same
+// order, one at a time, taking each message off the channel it went
+// through, so the run is reproduced however it was first scheduled.
+// Start from the same graph, a checkpoint taken when recording began
+// is the easy way.  Replay stops at the first delivery that doesn't
+// match, which is where the runs part.
+void start_recording();
+std::vector<std::byte> stop_recording(); // The trace so far
+struct ReplayResult{
+	enum Stop{Done,Diverged} stop;
+	unsigned long steps; // Deliveries made
+	explicit operator bool() const{return stop==Done;}
+};
+ReplayResult replay(std::span<std::byte const> trace);
+
+// Nodes
+// The top bits of a UID say which node, which process, it lives on;
+// it's node 0 unless set_node says otherwise.  A channel to a
+// properator on another node is a RemoteChannel, which batches what's
+// sent into frames on the socket to that node, and the far node makes
+// the receiving half of the link when the first message arrives.
+// Next of kin are told across nodes, and when a node goes away every
+// link to it is dropped and the local ends are told it crashed.
+// Nodes are joined by handing connect_node a socket, Unix domain or
+// TCP.  run_until_quiescent passes on whatever arrives, and returns
+// once nothing is left to do here and nothing is waiting on the
+// sockets; wait_for_network blocks until something is.
+constexpr int node_shift=48;
+inline unsigned node_of(UID id){return unsigned(id>>node_shift);}
+unsigned this_node();
+void set_node(unsigned node); // Before spawning anything
+bool connect_node(unsigned node,int fd); // Takes the socket
+// Addresses are "unix:/path" or "tcp:host:port", these return -1 on failure.
+int listen_on(char const* address);
+int accept_node(int listener);
+int dial(char const* address);
+bool wait_for_network(std::chrono::milliseconds timeout); // True if something came in
+struct RemoteChannel:Channel{
+	RemoteChannel(LinkSpec link):Channel(link){}
+	void send(Message m)override;
+	Message read()override{return Message({0});} // Nothing's ever held here
+	bool has_message() const override{return false;}
+	bool lock_free() const override{return true;}
+};
+
+// Timers
+// Messages posted later, once or every `period', through the channels
+// post would use.  Deadlines sit in a hierarchical timing wheel with a
+// millisecond tick, so adding or cancelling one costs the same however
+// many are waiting and a tick only looks at what's due.  Pending timers
+// are work: run_until_quiescent fires them as they come due, and when
+// that's all there is it sleeps until the next one (or until a node
+// sends something) rather than spinning or returning.  A timer stops by
+// itself once there's no route left for it, e.g. when its sender or
+// receiver is shut down.
+typedef unsigned long TimerID;
+TimerID post_after(std::chrono::steady_clock::duration delay,UID from,uint from_port,Message message);
+TimerID post_after(std::chrono::steady_clock::duration delay,UID from,uint from_port,UID to,uint to_port,Message message);
+TimerID post_every(std::chrono::steady_clock::duration period,UID from,uint from_port,Message message);
+TimerID post_every(std::chrono::steady_clock::duration period,UID from,uint from_port,UID to,uint to_port,Message message);
+bool cancel_timer(TimerID timer); // False if it had already gone
+
+// Metrics
+// Empty unless built with METRICS, see metrics.hpp.
+struct ChannelStats{
+	LinkSpec link;
+	unsigned long sent,received,depth,high_water;
+	Histogram::Counts dwell;
+};
+struct ProperatorStats{
+	UID id;
+	unsigned long received,busy_ns;
+	Histogram::Counts busy;
+};
+struct MetricsSnapshot{
+	std::vector<ChannelStats> channels;
+	std::vector<ProperatorStats> properators;
+};
+MetricsSnapshot metrics_snapshot();
+void metrics_dump(size_t top=10); // The busiest channels and properators
+// Dump from the main loop every `period', zero to stop.
+void metrics_dump_every(std::chrono::milliseconds period);
 #endif
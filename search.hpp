@@ -0,0 +1,120 @@
+#ifndef __SEARCH__
+#define __SEARCH__
+
+#include "lattice.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <optional>
+
+// Search
+// Propagation stops at a fixpoint, which can leave cells undecided.
+// search() then guesses: it takes an undecided cell with the fewest
+// choices left and tries each in turn, propagating after every guess.
+// The network, LatticeCells plus whatever `constrain' adds over them,
+// is built once.  At a fixpoint every channel is empty, so the saves
+// of its properators are the whole branch; a guess loads the snapshot
+// it was made from and tells its cell, and only what that changes is
+// propagated again.  A branch that fails is simply loaded over, so
+// there's nothing to undo.  A constraint that crashes is gone, so then
+// the network is built again before the next branch is loaded.
+// On top of what LatticeCell needs, the lattice says how to guess,
+//   static size_t size(value const&);              // Choices, 1 when decided
+//   static std::vector<value> split(value const&); // One value per choice
+// and `constrain' is given the cells' UIDs and returns the UIDs of the
+// properators it made, which have to save and load whatever they keep
+// about the cells.
+
+template<typename L> struct SearchResult{
+	std::optional<std::vector<typename L::value>> solution;
+	unsigned long branches=0,failures=0;
+	explicit operator bool() const{return bool(solution);}
+};
+
+template<typename L> SearchResult<L> search(std::vector<typename L::value> start,
+	std::function<std::vector<UID>(std::span<UID const>)> constrain){
+	typedef typename L::value value;
+	typedef LatticeCell<L,false> Cell;
+	typedef std::shared_ptr<std::vector<std::byte> const> Snapshot;
+	struct Guess{
+		Snapshot at;
+		size_t cell;
+		value choice;
+	};
+	SearchResult<L> r;
+	std::vector<std::shared_ptr<Cell>> cells;
+	std::vector<std::shared_ptr<Properator>> all; // Cells first, in snapshot order
+	std::vector<UID> ids;
+	auto build=[&](){
+		cells.clear();
+		all.clear();
+		ids.clear();
+		for(auto& v:start){
+			auto c=std::allocate_shared<Cell>(PoolAllocator<Cell>(),new_uid());
+			c->v=v;
+			register_properator(c);
+			cells.push_back(c);
+			all.push_back(c);
+			ids.push_back(c->id);
+		}
+		auto more=constrain(ids);
+		for(auto id:more)
+			all.push_back(find_properator(id));
+		ids.insert(ids.end(),more.begin(),more.end());
+		run_until_quiescent();
+	};
+	auto broken=[&](){
+		return std::any_of(all.begin(),all.end(),[](auto const&p){return !p or !p->alive;});
+	};
+	std::vector<Guess> todo; // Depth first
+	// Where the branch just run has got to.
+	auto settle=[&](){
+		bool failed=broken();
+		size_t guess=0,fewest=0;
+		for(size_t i=0;i<cells.size() and !failed;i++){
+			failed|=L::contradiction(cells[i]->v);
+			if(auto n=L::size(cells[i]->v);n>1 and (!fewest or n<fewest)){
+				fewest=n;
+				guess=i;}
+		}
+		if(failed)
+			r.failures++;
+		else if(!fewest){
+			r.solution.emplace();
+			for(auto& c:cells)
+				r.solution->push_back(c->v);
+		}else{
+			auto at=std::make_shared<std::vector<std::byte>>();
+			Writer w{*at};
+			for(auto& p:all)
+				p->save(w);
+			// Pushed backwards so the first choice is tried first.
+			auto choices=L::split(cells[guess]->v);
+			for(auto c=choices.rbegin();c!=choices.rend();c++)
+				todo.push_back({at,guess,std::move(*c)});
+		}
+	};
+	build();
+	r.branches++;
+	settle();
+	while(todo.size() and !r.solution){
+		auto g=std::move(todo.back());
+		todo.pop_back();
+		if(broken()){
+			crash_or_shutdown(false,ids,Message({"Branch done"}));
+			run_until_quiescent();
+			build();}
+		Reader rd{*g.at};
+		for(auto& p:all)
+			p->load(rd);
+		post(0,0,cells[g.cell]->id,1,Payload<value>::to(g.choice));
+		run_until_quiescent();
+		r.branches++;
+		settle();
+	}
+	crash_or_shutdown(false,ids,Message({"Search done"}));
+	run_until_quiescent();
+	return r;
+}
+
+#endif
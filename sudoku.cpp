@@ -0,0 +1,419 @@
+#include "sudoku.hpp"
+#include "domain.hpp"
+#include "lattice.hpp"
+#include "properator.hpp"
+#include "search.hpp"
+#include <algorithm>
+#include <bit>
+#include <map>
+#include <stdio.h>
+
+// for operator ""s
+using namespace std::string_literals;
+
+// Commands used by the network
+Symbol const AddCell("Add Cell"),Display("Display");
+
+// Which of 1..9 a cell can still be, bit v-1 for v.  Knowing more
+// means fewer bits, so join is and.
+struct SudokuDomain{
+	typedef int value;
+	static constexpr int all=0x1FF;
+	static int bottom(){return all;}
+	static int join(int a,int b){return a&b;}
+	static bool contradiction(int d){return !d;}
+	static int delta(int was,int is){return is|(all&~was);}
+	static size_t size(int d){return size_t(std::popcount(unsigned(d)));}
+	static std::vector<int> split(int d){
+		std::vector<int> v;
+		for(;d;d&=d-1)
+			v.push_back(d&-d);
+		return v;
+	}
+};
+int only(int d){return d and !(d&(d-1))?std::countr_zero(unsigned(d))+1:0;}
+int set(int val){return 1<<(val-1);}
+int ban(int val){return SudokuDomain::all&~set(val);}
+
+typedef LatticeCell<SudokuDomain> SudokuCell;
+
+// The cells of a row, column or box, and what each can still be.
+// A batch of changes is joined in before the subclass looks at the
+// whole group, so it only looks once however much arrived.
+// The cells' int domains are packed into Domains for the kernels in
+// domain.hpp, which only hold 16 values, so this is no good for grids
+// bigger than 16 by 16.
+static_assert(SudokuDomain::all<=0xFFFF,"Sudoku domains have to fit in a Domain.");
+struct SudokuGroup:Properator{
+	std::vector<UID> cells;
+	std::vector<Domain> domains; // Truncated from SudokuDomain's ints
+	SudokuGroup(UID id):Properator(id){}
+	virtual void propagate()=0;
+	// The cells are fixed once it's built, only the domains change.
+	void save(Writer& w) const override{
+		w.pod(uint32_t(domains.size()));
+		for(auto d:domains)
+			w.pod(d);
+	}
+	void load(Reader& r)override{
+		if(r.pod<uint32_t>()!=domains.size()){
+			r.ok=false;
+			return;}
+		for(auto& d:domains)
+			d=r.pod<Domain>();
+	}
+	// Tell a cell what it can't be, unless it already knows.  The copy
+	// here is updated straight away so it's never told twice.
+	void tell(size_t cell,int d){
+		if((domains[cell]&d)==domains[cell]) return;
+		domains[cell]&=Domain(d);
+		post(id,1,cells[cell],1,Message({d}));
+	}
+	void receive_batch(std::span<Message> ms,uint port,UID from,uint from_port,std::shared_ptr<Properator> self)override{
+		if(port!=1){
+			Properator::receive_batch(ms,port,from,from_port,std::move(self));
+			return;}
+		// message::delta
+		auto i=size_t(std::find(cells.begin(),cells.end(),from)-cells.begin());
+		for(auto&m:ms)
+			if(i<cells.size() and std::holds_alternative<int>(m.body))
+				domains[i]&=Domain(std::get<int>(m.body));
+			else{
+				crash_or_shutdown(true,id,std::move(m));
+				return;}
+		propagate();
+	}
+	void receive(Message m, uint port,UID from,uint from_port,std::shared_ptr<Properator> self){
+		switch(port){
+		case 0:
+			// ["Add Cell", UID]
+			// ["Shutting Down" . TAIL]
+			if(std::holds_alternative<Tuple>(m.body)){
+				auto const& v = std::get<Tuple>(m.body);
+				if(v.size()==2)
+					if(std::holds_alternative<Symbol>(v[0].body)){
+						auto vv = std::get<Symbol>(v[0].body);
+						if(vv==AddCell)
+							if(std::holds_alternative<UID>(v[1].body)){
+								auto c=std::get<UID>(v[1].body);
+								cells.push_back(c);
+								domains.push_back(SudokuDomain::all);
+								if(cells.size()>9)
+									crash_or_shutdown(true,id,Message({Tuple{
+														Message({"Too many sub-cells: "s+std::to_string(cells.size())}),
+														m}}));
+								make_channel<BasicChannel>({id,1,c,1});
+								make_channel<JoinChannel<SudokuDomain>>({c,1,id,1});
+								post(id,1,c,1,Message({Query}));
+								break;
+							}
+					}
+				if(v.size())
+					if(std::holds_alternative<Symbol>(v[0].body)){
+						auto vv = std::get<Symbol>(v[0].body);
+						if(vv==ShuttingDown)
+							break;}}
+			crash_or_shutdown(true,id,m);
+			break;
+		case 1:
+			receive_batch(std::span<Message>(&m,1),port,from,from_port,std::move(self));
+			break;
+		default:
+			crash_or_shutdown(true,id,m);
+		}
+	}
+};
+struct SudokuValueAtMostOnce:SudokuGroup{
+	SudokuValueAtMostOnce(UID id):SudokuGroup(id){}
+	void propagate(){
+		// A decided value is banned from the rest.  Two cells decided
+		// on the same value are both banned it, and crash.
+		auto s=scan_group(domains.data(),cells.size());
+		for(size_t i=0;i<cells.size();i++){
+			Domain own=single(domains[i])?Domain(domains[i]&~s.clash):0;
+			tell(i,SudokuDomain::all&~(s.fixed&~own));
+		}
+		// Two cells that can only be the same two values take those
+		// values from the rest.
+		NakedPair pairs[9/2];
+		for(size_t p=0,n=naked_pairs(domains.data(),cells.size(),pairs);p<n;p++)
+			for(size_t i=0;i<cells.size();i++)
+				if(!(pairs[p].cells>>i&1))
+					tell(i,SudokuDomain::all&~pairs[p].values);
+	}
+};
+struct SudokuValueAtLeastOnce:SudokuGroup{
+	SudokuValueAtLeastOnce(UID id):SudokuGroup(id){}
+	void propagate(){
+		// Until the group is whole, every value looks like it has one
+		// place left.
+		if(cells.size()<9) return;
+		// A value with only one place left goes there.
+		for(Domain h=scan_group(domains.data(),cells.size()).hidden;h;h&=Domain(h-1))
+			for(size_t i=0;i<cells.size();i++)
+				if(domains[i]&h&-h){
+					tell(i,h&-h);
+					break;}
+	}
+};
+struct SudokuGridDisplay:Properator{
+	std::vector<UID> cells;
+	std::map<UID,int> values;
+	SudokuGridDisplay(UID id):Properator(id){}
+	void receive(Message m, uint port,UID from,uint,std::shared_ptr<Properator>){
+		switch(port){
+			case 0:
+			if(std::holds_alternative<Tuple>(m.body)){
+				auto const& v = std::get<Tuple>(m.body);
+				if(v.size()==2)
+					if(std::holds_alternative<Symbol>(v[0].body)){
+						auto vv = std::get<Symbol>(v[0].body);
+						if(vv==AddCell)
+							if(std::holds_alternative<UID>(v[1].body)){
+								auto c=std::get<UID>(v[1].body);
+								cells.push_back(c);
+								if(cells.size()>81)
+									crash_or_shutdown(true,id,m); // TODO: Elaborate
+								values[c]=SudokuDomain::all;
+								make_channel<OnlyLatests>({id,1,c,1});
+								make_channel<JoinChannel<SudokuDomain>>({c,1,id,1});
+								post(id,1,c,1,Message({Query}));
+								break;
+							}
+					}
+				if(v.size())
+					if(std::holds_alternative<Symbol>(v[0].body)){
+						auto vv = std::get<Symbol>(v[0].body);
+						if(vv==ShuttingDown)
+							break;}}
+			// if cell crash or shutdown, crash
+			// might change later with an actual grid rather than just a list of cells
+			crash_or_shutdown(true,id,m);
+			break;
+		case 1:
+			if(std::holds_alternative<Symbol>(m.body)){
+				auto v = std::get<Symbol>(m.body);
+				if(v==Display){
+					if(cells.size()!=81){
+						crash_or_shutdown(true,id,m); // TODO: Elaborate
+						break;}
+					printf("\n");
+					for(int row=0;row<9;row++){
+						if(row==3 or row==6)
+							printf("---+---+---\n");
+						for(int col=0;col<9;col++){
+							auto val=only(values[cells[row*9+col]]);
+							if(col==3 or col==6)
+								printf("|");
+							if(val)
+								printf("%d",val);
+							else
+								printf("_");}
+						printf("\n");}
+					break;
+				}
+			}else if(std::holds_alternative<int>(m.body)){
+				values[from]&=std::get<int>(m.body);
+				// Assert that that's an increase
+				// assert that from was already in the map
+				break;
+			}
+			crash_or_shutdown(true,id,m);
+			break;
+		default:
+			crash_or_shutdown(true,id,m);
+		}
+	}
+};
+#ifdef DEBUG
+struct SudokuGridVerboseDisplay:Properator{
+	std::vector<UID> cells;
+	std::map<UID,int> values;
+	SudokuGridVerboseDisplay(UID id):Properator(id){}
+	void receive(Message m, uint port,UID from,uint,std::shared_ptr<Properator>){
+		auto display=[&](){
+			printf("\n");
+			for(size_t row=0;row<9;row++){
+				if(row==3 or row==6)
+					printf("---+---+---+++---+---+---+++---+---+---\n\n");
+				for(size_t sub_row=0;sub_row<3;sub_row++){
+					for(size_t col=0;col<9;col++){
+						if(col==3 or col==6)
+							printf("| ");
+						for(size_t sub_col=0;sub_col<3;sub_col++){
+							auto val=3*sub_row+sub_col;
+							bool has=true;
+							if(cells.size()>row*9+col)
+								has=values[cells[row*9+col]]&(1<<val);
+							if(has)
+								printf("%d",val+1);
+							else
+								printf("_");}
+						printf(" ");}
+					printf("\n\n");}}
+			printf("\n\n---\n");
+		};
+		switch(port){
+			case 0:
+			if(std::holds_alternative<Tuple>(m.body)){
+				auto const& v = std::get<Tuple>(m.body);
+				if(v.size()==2)
+					if(std::holds_alternative<Symbol>(v[0].body)){
+						auto vv = std::get<Symbol>(v[0].body);
+						if(vv==AddCell)
+							if(std::holds_alternative<UID>(v[1].body)){
+								auto c=std::get<UID>(v[1].body);
+								cells.push_back(c);
+								if(cells.size()>81)
+									crash_or_shutdown(true,id,m); // TODO: Elaborate
+								values[c]=SudokuDomain::all;
+								make_channel<BasicChannel>({id,1,c,1});
+								make_channel<JoinChannel<SudokuDomain>>({c,1,id,1});
+								post(id,1,c,1,Message({Query}));
+								break;
+							}
+					}
+				if(v.size())
+					if(std::holds_alternative<Symbol>(v[0].body)){
+						auto vv = std::get<Symbol>(v[0].body);
+						if(vv==ShuttingDown)
+							break;
+						if(vv==Crashed) // Don't die on crashes, I need the logging
+							break;}}
+			crash_or_shutdown(true,id,m);
+			break;
+		case 1:
+			if(std::holds_alternative<Symbol>(m.body)){
+				auto v = std::get<Symbol>(m.body);
+				if(v==Display){
+					if(cells.size()!=81){
+						crash_or_shutdown(true,id,m); // TODO: Elaborate
+						break;}
+					display();
+					break;
+				}
+			}else if(std::holds_alternative<int>(m.body)){
+				int was=values[from];
+				values[from]&=std::get<int>(m.body);
+				if(values[from]!=was)
+					display();
+				break;
+			}
+			crash_or_shutdown(true,id,m);
+			break;
+		default:
+			crash_or_shutdown(true,id,m);
+		}
+	}
+};
+#endif
+// The rows, columns and boxes over 81 cells in reading order.
+std::vector<UID> sudoku_constraints(std::span<UID const> cells){
+	std::vector<UID> one_hots;
+	//printf("- Make the rows\n");
+	for(int row=0;row<9;row++){
+		one_hots.push_back(spawn_properator<SudokuValueAtMostOnce>());
+		for(int col=0;col<9;col++)
+			post(0,0,one_hots.back(),0,Message({Tuple{
+								Message({AddCell}),
+								Message({cells[row*9+col]})}}));
+		one_hots.push_back(spawn_properator<SudokuValueAtLeastOnce>());
+		for(int col=0;col<9;col++)
+			post(0,0,one_hots.back(),0,Message({Tuple{
+								Message({AddCell}),
+								Message({cells[row*9+col]})}}));
+	}
+
+	//printf("- Make the cols\n");
+	for(int col=0;col<9;col++){
+		one_hots.push_back(spawn_properator<SudokuValueAtMostOnce>());
+		for(int row=0;row<9;row++)
+			post(0,0,one_hots.back(),0,Message({Tuple{
+								Message({AddCell}),
+								Message({cells[row*9+col]})}}));
+		one_hots.push_back(spawn_properator<SudokuValueAtLeastOnce>());
+		for(int row=0;row<9;row++)
+			post(0,0,one_hots.back(),0,Message({Tuple{
+								Message({AddCell}),
+								Message({cells[row*9+col]})}}));
+	}
+
+	//printf("- Make the boxes\n");
+	for(int box=0;box<9;box++){
+		auto
+			r_min=3*(box/3),
+			c_min=3*(box%3);
+		one_hots.push_back(spawn_properator<SudokuValueAtMostOnce>());
+		for(int row=r_min;row<r_min+3;row++)
+			for(int col=c_min;col<c_min+3;col++)
+				post(0,0,one_hots.back(),0,Message({Tuple{
+									Message({AddCell}),
+									Message({cells[row*9+col]})}}));
+		one_hots.push_back(spawn_properator<SudokuValueAtLeastOnce>());
+		for(int row=r_min;row<r_min+3;row++)
+			for(int col=c_min;col<c_min+3;col++)
+				post(0,0,one_hots.back(),0,Message({Tuple{
+									Message({AddCell}),
+									Message({cells[row*9+col]})}}));
+	}
+	return one_hots;
+}
+void sudoku_solver(int initial[9][9],unsigned threads,bool display){
+	std::vector<UID> cells;
+	for(int row=0;row<9;row++)
+		for(int col=0;col<9;col++){
+			cells.push_back(spawn_properator<SudokuCell>());
+			if(initial[row][col])
+				post(0,0,cells.back(),1,Message({set(initial[row][col])}));
+		}
+
+	auto displayer=spawn_properator<SudokuGridDisplay>();
+	for(auto&c:cells)
+		post(0,0,displayer,0,Message(Tuple{
+							Message({AddCell}),
+							Message({c})}));
+
+	#ifdef DEBUG
+	auto displayerv=spawn_properator<SudokuGridVerboseDisplay>();
+	for(auto&c:cells)
+		post(0,0,displayerv,0,Message(Tuple{
+							Message({AddCell}),
+							Message({c})}));
+	#endif
+	
+	auto one_hots=sudoku_constraints(cells);
+
+	run(threads);
+	if(display){
+		post(0,0,displayer,1,Message({Display}));
+		run(threads);}
+
+	std::vector<UID> all(cells.begin(),cells.end());
+	all.push_back(displayer);
+	all.insert(all.end(),one_hots.begin(),one_hots.end());
+	crash_or_shutdown(false,all,Message({"Example Over"}));
+
+	run(threads);
+}
+bool sudoku_search(int grid[9][9],bool display){
+	std::vector<int> start;
+	for(int row=0;row<9;row++)
+		for(int col=0;col<9;col++)
+			start.push_back(grid[row][col]?set(grid[row][col]):SudokuDomain::all);
+	auto r=search<SudokuDomain>(std::move(start),sudoku_constraints);
+	if(!r) return false;
+	for(int row=0;row<9;row++)
+		for(int col=0;col<9;col++)
+			grid[row][col]=only((*r.solution)[row*9+col]);
+	if(display){
+		printf("\n");
+		for(int row=0;row<9;row++){
+			if(row==3 or row==6)
+				printf("---+---+---\n");
+			for(int col=0;col<9;col++){
+				if(col==3 or col==6)
+					printf("|");
+				printf("%d",grid[row][col]);}
+			printf("\n");}}
+	return true;
+}
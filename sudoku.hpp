@@ -0,0 +1,12 @@
+#ifndef __SUDOKU__
+#define __SUDOKU__
+
+// Build a propagator network for a 9x9 grid (0 for blank), run it to a
+// fixpoint, optionally print the grid, and tear it all down again.
+// Only solves what constraint propagation alone can.
+void sudoku_solver(int initial[9][9],unsigned threads,bool display);
+// Guesses where propagation gets stuck, see search.hpp.  Fills in the
+// grid and returns true if there's a solution.
+bool sudoku_search(int grid[9][9],bool display);
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef __TYPED__
+#define __TYPED__
+
+#include "properator.hpp"
+
+#include <algorithm>
+#include <array>
+#include <tuple>
+#include <utility>
+
+// Typed Ports
+// A properator lists its ports and their payloads,
+//   struct P:TypedProperator<P,In<1,int>,Out<1,std::pair<int,int>>>{
+//     void on(In<1,int>,int n){emit<1>(std::pair{n,n});}
+//   };
+// and gets a receive that decodes each port's payload, calls the
+// matching `on' through a table built at compile time, and crashes on
+// anything malformed.  Handlers may also take (value,from,from_port).
+// make_channel refuses to connect ports whose types differ.
+
+// How a C++ value travels as a Message.
+template<typename T> struct Payload{
+	static std::optional<T> from(Message const&m){
+		if(auto v=std::get_if<T>(&m.body)) return *v;
+		return {};}
+	static Message to(T const&v){return Message({v});}
+};
+template<> struct Payload<Message>{
+	static std::optional<Message> from(Message const&m){return m;}
+	static Message to(Message const&m){return m;}
+};
+template<> struct Payload<bool>{
+	static std::optional<bool> from(Message const&m){
+		if(auto v=std::get_if<int>(&m.body)) return bool(*v);
+		return {};}
+	static Message to(bool v){return Message({int(v)});}
+};
+// Fixed size tuples go as a Tuple of their elements.
+template<typename T,typename... Ts> struct TuplePayload{
+	template<size_t... I> static std::optional<T> decode(Tuple const&t,std::index_sequence<I...>){
+		std::tuple<std::optional<Ts>...> parts{Payload<Ts>::from(t[I])...};
+		if(!(std::get<I>(parts) and ...)) return {};
+		return T{std::move(*std::get<I>(parts))...};
+	}
+	static std::optional<T> from(Message const&m){
+		auto t=std::get_if<Tuple>(&m.body);
+		if(!t or t->size()!=sizeof...(Ts)) return {};
+		return decode(*t,std::index_sequence_for<Ts...>());
+	}
+	static Message to(T const&v){
+		return std::apply([](auto const&... e){return Message({Tuple{Payload<Ts>::to(e)...}});},v);}
+};
+template<typename A,typename B> struct Payload<std::pair<A,B>>:TuplePayload<std::pair<A,B>,A,B>{};
+template<typename... Ts> struct Payload<std::tuple<Ts...>>:TuplePayload<std::tuple<Ts...>,Ts...>{};
+template<typename T,size_t N> struct Payload<std::array<T,N>>{
+	static std::optional<std::array<T,N>> from(Message const&m){
+		auto t=std::get_if<Tuple>(&m.body);
+		if(!t or t->size()!=N) return {};
+		std::array<T,N> a;
+		for(size_t i=0;i<N;i++)
+			if(auto v=Payload<T>::from((*t)[i]))
+				a[i]=std::move(*v);
+			else
+				return {};
+		return a;
+	}
+	static Message to(std::array<T,N> const&a){
+		std::vector<Message> v;
+		for(auto const&e:a)
+			v.push_back(Payload<T>::to(e));
+		return Message({Tuple(v)});
+	}
+};
+
+template<unsigned N,typename T> struct In{
+	static constexpr unsigned port=N;
+	static constexpr bool input=true;
+	typedef T type;
+};
+template<unsigned N,typename T> struct Out{
+	static constexpr unsigned port=N;
+	static constexpr bool input=false;
+	typedef T type;
+};
+
+template<typename Derived,typename... Ports> struct TypedProperator:Properator{
+	TypedProperator(UID _id):Properator(_id){}
+
+	// The payload type of an output port.
+	template<unsigned N> struct OutPort{
+		static_assert(((!Ports::input and Ports::port==N) or ...),"No such output port");
+		typedef std::tuple_element_t<0,decltype(std::tuple_cat(
+			std::conditional_t<!Ports::input and Ports::port==N,
+												 std::tuple<typename Ports::type>,std::tuple<>>()...))> type;
+	};
+	template<unsigned N> using out_t=typename OutPort<N>::type;
+	template<unsigned N> struct InPort{
+		static_assert(((Ports::input and Ports::port==N) or ...),"No such input port");
+		typedef std::tuple_element_t<0,decltype(std::tuple_cat(
+			std::conditional_t<Ports::input and Ports::port==N,
+												 std::tuple<typename Ports::type>,std::tuple<>>()...))> type;
+	};
+	template<unsigned N> using in_t=typename InPort<N>::type;
+
+	template<unsigned N> Posted emit(out_t<N> const&v){
+		return post(id,N,Payload<out_t<N>>::to(v));}
+	template<unsigned N> Posted emit(UID to,out_t<N> const&v){
+		return post(id,N,to,Payload<out_t<N>>::to(v));}
+	template<unsigned N> Posted emit(UID to,uint to_port,out_t<N> const&v){
+		return post(id,N,to,to_port,Payload<out_t<N>>::to(v));}
+
+	// Port 0, shadow this to do more than ignore shutdowns.
+	void on_system(Message m,UID,uint){
+		if(auto t=std::get_if<Tuple>(&m.body))
+			if(t->size())
+				if(auto head=(*t)[0];std::holds_alternative<Symbol>(head.body) and
+					 std::get<Symbol>(head.body)==ShuttingDown)
+					return;
+		crash_or_shutdown(true,id,std::move(m));
+	}
+
+	void receive(Message m,uint port,UID from,uint from_port,std::shared_ptr<Properator>)override{
+		static constexpr auto table=make_table();
+		auto& self=static_cast<Derived&>(*this);
+		if(port==0)
+			self.on_system(std::move(m),from,from_port);
+		else if(port<table.size() and table[port])
+			table[port](self,m,from,from_port);
+		else
+			crash_or_shutdown(true,id,std::move(m));
+	}
+	std::type_info const* in_type(uint port) const override{
+		std::type_info const* t=nullptr;
+		((Ports::input and Ports::port==port and (t=&typeid(typename Ports::type))),...);
+		return t;
+	}
+	std::type_info const* out_type(uint port) const override{
+		std::type_info const* t=nullptr;
+		((!Ports::input and Ports::port==port and (t=&typeid(typename Ports::type))),...);
+		return t;
+	}
+private:
+	typedef void(*Handler)(Derived&,Message&,UID,uint);
+	template<typename P> static void handle(Derived& self,Message& m,UID from,uint from_port){
+		auto v=Payload<typename P::type>::from(m);
+		if(!v){
+			crash_or_shutdown(true,self.id,std::move(m));
+			return;}
+		if constexpr(requires{self.on(P(),std::move(*v),from,from_port);})
+			self.on(P(),std::move(*v),from,from_port);
+		else
+			self.on(P(),std::move(*v));
+	}
+	template<typename P> static constexpr Handler handler(){
+		if constexpr(P::input) return &handle<P>;
+		else return nullptr;
+	}
+	// Indexed by input port, built when receive is first instantiated.
+	static constexpr auto make_table(){
+		std::array<Handler,std::max({1u,(Ports::input?Ports::port+1:0u)...})> t{};
+		((Ports::input and (t[Ports::port]=handler<Ports>(),true)),...);
+		return t;
+	}
+};
+
+// Connect two typed properators, checking the payloads at compile time.
+template<typename C,typename From,unsigned FromPort,typename To,unsigned ToPort>
+std::shared_ptr<Channel> connect(UID from,UID to){
+	static_assert(std::is_same_v<typename From::template out_t<FromPort>,
+								typename To::template in_t<ToPort>>,"Ports carry different payloads");
+	return make_channel<C>({from,FromPort,to,ToPort});
+}
+
+#endif